@@ -10,20 +10,72 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef KILO_ALLOC_PROFILE
+#include <malloc.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /* Defines */
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+// Most iovecs handed to one writev when saving (IOV_MAX is at least 1024 on Linux)
+#define KILO_SAVE_IOV 512
+// Bytes of edited text the save thread copies out per batch
+#define KILO_SAVE_CHUNK (1 << 20)
+// Searches over fewer rows than this aren't worth splitting between threads
+#define KILO_FIND_PARALLEL 65536
+// Parts each search thread's share is cut into, so threads that finish early can help the others
+#define KILO_FIND_SPLIT 4
+// Rows walked per slice of background highlighting
+#define KILO_HL_SLICE 4096
+// Render columns between the lexer states kept along a long row, so an edit only re-lexes near itself
+#define KILO_HL_MARK 4096
+// Shortest time between two screen refreshes while keys keep coming, in milliseconds
+#define KILO_FRAME_MS 16
+// How often a running save's progress is shown, in milliseconds
+#define KILO_SAVE_TICK_MS 100
+// Regex limits: largest {m,n} count, instructions in a compiled pattern and DFA states kept (a power of two)
+#define KILO_REGEX_REPEAT 1000
+#define KILO_REGEX_INST 20000
+#define KILO_REGEX_STATES 1024
+// Journal entries are written this long after the first of them, or straight away once there are this many bytes
+#define KILO_JOURNAL_MS 250
+#define KILO_JOURNAL_BATCH 65536
+// Buckets in each latency histogram, enough for any time up to minutes
+#define KILO_LAT_BUCKETS 320
+// Call sites the allocation profile can tell apart
+#define KILO_ALLOC_SITES 1024
+// Viewing: rows kept in memory, most bytes of the file mapped for them at once, lines between index entries, and
+// bytes read at a time when counting lines
+#define KILO_VIEW_ROWS 4096
+#define KILO_VIEW_SPAN (8 << 20)
+#define KILO_VIEW_STRIDE 1024
+#define KILO_VIEW_READ (1 << 20)
+// Chunked editing: bytes of the file per chunk, chunks kept in the window, and megabytes of changed chunks
+// kept in memory before they are spilled, unless the config says otherwise
+#define KILO_CHUNK_SIZE (1 << 20)
+#define KILO_CHUNK_WINDOW 3
+#define KILO_CHUNK_MEMORY 256
 // Emulate Ctrl press
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -40,7 +92,9 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    // Start of a bracketed paste: the pasted text follows, up to <esc>[201~
+    PASTE_START
 };
 
 // Highlighting codes
@@ -60,7 +114,49 @@ enum editorHighlight {
 // Flag to highlight strings
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+// Row flag: chars points into the mmap'd original file rather than a heap buffer
+#define ROW_MAPPED (1<<0)
+// Row flags: render, the end of line lexer state (hl_open_comment) or hl need rebuilding before use
+#define ROW_STALE_RENDER (1<<1)
+#define ROW_STALE_STATE (1<<2)
+#define ROW_STALE_HL (1<<3)
+// Row render points into chars instead of a buffer of its own (tab-free row with no gap in the middle)
+#define ROW_SHARED_RENDER (1<<4)
+// hl_to of a row whose hl needs lexing from the start
+#define ROW_HL_ALL 0x7fffffff
+
+// Max rows held in a leaf of the row tree, and max children of an inner node
+#define ROW_LEAF_MAX 64
+#define ROW_NODE_MAX 32
+
+// Smallest gap left in a row buffer when it is copied out of the map
+#define ROW_GAP_MIN 16
+
+// Screen cell attributes: the foreground colour code, 0 for default, plus reverse video.
+// ATTR_UNKNOWN marks shadow cells whose contents on the terminal aren't known, so they never match
+#define ATTR_REVERSE 0x80
+#define ATTR_UNKNOWN 0xff
+// Character at index j of a row, skipping over the gap
+#define ROW_CHAR(row, j) ((row)->chars[(j) < (row)->gap ? (j) : (j) + (row)->gaplen])
+
 /* Data */
+struct keywordEntry {
+    // Keyword text (points into the syntax's keywords array, not null terminated at len)
+    char *word;
+    int len;
+    // HL_KEYWORD1 or HL_KEYWORD2, from the trailing |
+    unsigned char hl;
+};
+
+// Keywords of a syntax compiled into an open addressing hash table
+struct keywordTable {
+    // Number of slots is a power of two, mask is that minus one
+    struct keywordEntry *slots;
+    unsigned int mask;
+    // Longest keyword, so longer words skip the lookup
+    int maxlen;
+};
+
 struct editorSyntax {
     // Name of filetype to be displayed in bar
     char *filetype;
@@ -76,24 +172,123 @@ struct editorSyntax {
     char *multiline_comment_end;
     // Bit flags for whether to highlight numbers and strings
     int flags;
+    // keywords compiled for lookup, built the first time the syntax is selected
+    struct keywordTable *kwtable;
+};
+
+// Lexer state at a point in a row's render, so lexing can pick up there instead of at the start of the row
+struct hlMark {
+    int i;
+    unsigned char in_comment;
+    unsigned char in_string;
+    unsigned char prev_sep;
+    // hl of the character before i, which the lexer looks back at
+    unsigned char prev_hl;
+};
+
+// Marks along a long row, in order, about KILO_HL_MARK render columns apart
+struct hlMarks {
+    int n;
+    int cap;
+    struct hlMark m[];
 };
 
 typedef struct erow {
-    // Index within the file
-    int idx;
+    // Leaf of the row tree this row currently lives in
+    struct rowNode *leaf;
     // Row of text in the editor
     int size;
     int rsize;
-    // Actual text buffer
+    // Actual text buffer.  Holds size characters with a gap of gaplen unused bytes at index gap,
+    // so typing at the gap doesn't move the rest of the line
     char *chars;
-    // Render text buffer
+    int gap;
+    int gaplen;
+    // Number of tabs in chars, -1 until counted
+    int tabs;
+    // Render text buffer, and bytes allocated for it and hl.  Not null terminated if it shares chars
     char *render;
+    int rcap;
     // Text highlighting information
     unsigned char *hl;
-    // Contains unclosed multiline comment
+    // Contains unclosed multiline comment.  This is the lexer state at the end of the row: when re-lexing
+    // a row gives the same state as before, the rows below it don't need looking at
     int hl_open_comment;
+    // Render columns of hl that edits have changed since it was last lexed: none if hl_from is -1, the whole
+    // row if hl_to is ROW_HL_ALL.  Anything after hl_to has been moved along with render and is still right
+    int hl_from;
+    int hl_to;
+    // Lexer state along the row, for rows longer than KILO_HL_MARK, otherwise NULL
+    struct hlMarks *marks;
+    // ROW_* flags
+    int flags;
 } erow;
 
+// Node of the row tree.  Leaves hold the rows themselves, inner nodes hold child nodes.
+// Every node knows how many rows and bytes are below it, so a row can be found from its line number in O(log n)
+struct rowNode {
+    struct rowNode *parent;
+    // 1 if this node holds rows, 0 if it holds children
+    int leaf;
+    // Number of rows/children held directly by this node
+    int n;
+    // Totals for the whole subtree (bytes count a newline per row)
+    int numrows;
+    long long numbytes;
+    // Rows, for leaves
+    erow *rows;
+    // Children, for inner nodes
+    struct rowNode **child;
+    // Leaves: place in the running save's snapshot, or -1 once the save no longer needs this leaf left alone
+    int save_idx;
+};
+
+// Copy of a leaf's rows as they were when a save started, taken before the leaf is first changed.
+// Edited text is copied too, mapped text is left pointing into the map
+struct saveLeaf {
+    int n;
+    erow *rows;
+};
+
+// Text for a save that isn't in the row tree, for files opened with --chunked: len bytes of text, or if that
+// is NULL, of fd from off
+struct saveExtent {
+    const char *text;
+    int fd;
+    long long off;
+    long long len;
+};
+
+// A save running in the background.  The snapshot is the list of leaves at the time of Ctrl-S: the writer reads
+// each one in turn, or its saveLeaf if it has been changed since.  The main thread holds lock except while waiting
+// for a key, so the writer only ever sees the rows when nothing is changing them
+struct saveJob {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct rowNode **leaves;
+    struct saveLeaf **saved;
+    int nleaves;
+    // Next leaf the writer will read.  Leaves before it don't need keeping
+    int next;
+    // Temporary file being written, and the file it replaces
+    int fd;
+    char *tmp;
+    char *path;
+    // Bytes to write and written so far, for progress
+    long long total;
+    long long written;
+    // E.dirty when the snapshot was taken, and where the journal was up to
+    int dirty;
+    long long journal;
+    // Text outside the row tree, in file order: extents before split come before the rows, the rest after
+    struct saveExtent *extents;
+    int nextents;
+    int split;
+    // Set by the writer when it is finished, with errno of any failure
+    int done;
+    int err;
+};
+
 struct editorConfig {
     // Cursor position
     int cx, cy;
@@ -106,10 +301,11 @@ struct editorConfig {
     // Number of rows and columns in terminal
     int screenrows;
     int screencols;
-    // Number of rows in file
-    int numrows;
-    // Array of rows
-    erow *row;
+    // Root of the row tree
+    struct rowNode *rows;
+    // Original file contents, mapped read only.  Unedited rows point straight into this
+    char *map;
+    size_t maplen;
     // Dirty flag - has buffer been modified
     int dirty;
     // Name of currently open file
@@ -120,6 +316,28 @@ struct editorConfig {
     time_t statusmsg_time;
     // Syntax highlighting
     struct editorSyntax *syntax;
+    // Rows before this one have an up to date hl_open_comment
+    int hl_stale_from;
+    // Number of rows flagged ROW_STALE_STATE, left for idle time
+    int hl_pending;
+    // Save running in the background, or NULL, and whether Ctrl-S was pressed again while it ran
+    struct saveJob *save;
+    int save_pending;
+    // Screen frame being drawn, and a shadow of the frame last written to the terminal.
+    // One character and one attribute (ATTR_*) per cell, frame_rows by frame_cols
+    char *frame;
+    unsigned char *frame_attr;
+    char *shadow;
+    unsigned char *shadow_attr;
+    int frame_rows;
+    int frame_cols;
+    // Where the terminal cursor was left last frame, -1 if unknown
+    int shadow_cy, shadow_cx;
+    // Where keys are read from, -1 for only those queued with editorFeedInput
+    int infd;
+    // Where frames are written, -1 to only draw them in memory.  Bytes the last frame took
+    int outfd;
+    int frame_bytes;
     // Save original termios config to return to
     struct termios orig_termios;
 };
@@ -132,6 +350,18 @@ struct userConfig {
     int tabNo;
     // Times to hit Ctrl-Q to quit without saving
     int quitTimes;
+    // fsync saved files before replacing the original
+    int saveSync;
+    // Milliseconds between fsyncs of the journal, 0 for never
+    int journalSync;
+    // Threads used to search, counting the main one
+    int findThreads;
+    // File latency histograms are added to at exit, or NULL
+    char *latencyLog;
+    // File the allocation profile is written to at exit, in profiling builds
+    char *allocLog;
+    // Megabytes of changed chunks kept in memory with --chunked
+    int chunkMemory;
 };
 
 struct userConfig U;
@@ -142,7 +372,7 @@ int quit_times;
 
 // Extensions for filetypes
 char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
-char *Python_HL_Extensions[] = {".py"};
+char *Python_HL_Extensions[] = {".py", NULL};
 
 // Keywords. keywords1 are NULL terminated, keywords2 are pipe terminated
 char *C_HL_keywords[] = {
@@ -177,14 +407,16 @@ struct editorSyntax HLDB[] = {
         C_HL_extensions,
         C_HL_keywords,
         "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     },
     {
         "Python",
         Python_HL_Extensions,
         Python_HL_keywords,
         "#", "\"\"\"", "\"\"\"",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     }
 };
 
@@ -194,21 +426,270 @@ struct editorSyntax HLDB[] = {
 void editorSetStatusMessage(const char *fmt, ...);
 
 void editorRefreshScreen();
+void editorFrameInvalidate();
 
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
 
+void editorRowRender(erow *row);
+
+void editorMarkStale(erow *row);
+
+int editorWaitInput(int timeout);
+void editorSaveTouch(struct rowNode *leaf);
+void editorSave();
+
+void editorMatchRowChanged(int at);
+void editorMatchRowsInserted(int at, int count);
+void editorMatchRowsDeleted(int at, int count);
+
+char *editorRowText(erow *row);
+
+// Undo log operations: text put in or taken out
+#define UNDO_INSERT 0
+#define UNDO_DELETE 1
+void editorUndoRecord(int type, int row, int col, const char *s, int len, int newline);
+void editorMatchClear();
+void editorFindReset();
+
+long long editorNowMs();
+void editorJournalAdd(int type, int row, int col, const char *s, int len, int newline);
+void editorJournalFlush();
+long long editorJournalMark(const char *filename);
+void editorJournalSaved(const char *filename, long long mark);
+void editorHangup();
+int editorReplayRead();
+void editorRecordInput(const char *buf, int len);
+void editorInitCore(int rows, int cols);
+void editorChunkRowChanged(int at);
+void editorChunkRowsInserted(int at, int count);
+void editorChunkRowsDeleted(int at, int count);
+void editorChunkExtents(struct saveJob *job);
+void editorChunkSaved();
+
+/* Allocation profile */
+// Built with -DKILO_ALLOC_PROFILE (make alloc), every malloc, calloc, realloc, strdup and free in this file
+// goes through the counting wrappers below, and each call site keeps a tally of calls and bytes asked for.
+// The main thread's allocations are also totalled per key handled and per frame drawn.  At exit the report is
+// written to the alloclog file from the config, or kilo-alloc.log.  In a normal build the per-key and
+// per-frame hooks do nothing
+struct allocSite {
+    const char *func;
+    int line;
+    long long calls;
+    long long bytes;
+};
+
+// Allocations made by the main thread between two points, one sample of a key or frame
+struct allocSpan {
+    long long calls;
+    long long bytes;
+};
+
+struct allocTally {
+    long long samples;
+    long long calls;
+    long long bytes;
+    long long max_calls;
+    long long max_bytes;
+};
+
+#define ALLOC_KEY 0
+#define ALLOC_FRAME 1
+
+#ifdef KILO_ALLOC_PROFILE
+struct allocProfile {
+    pthread_t main;
+    struct allocSite sites[KILO_ALLOC_SITES];
+    int nsites;
+    // Everything, then the main thread's share
+    long long calls;
+    long long frees;
+    long long bytes;
+    long long live;
+    long long main_calls;
+    long long main_bytes;
+    struct allocTally tally[2];
+};
+
+struct allocProfile allocProf;
+// Held while counting, as the save and search threads allocate too
+pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;
+
+void allocCount(size_t size, size_t oldsize, size_t newsize, const char *func, int line) {
+    // Tally a call from func:line that asked for size bytes, growing the heap from oldsize to newsize
+    pthread_mutex_lock(&allocLock);
+    unsigned h = ((unsigned)line * 2654435761u) ^ (unsigned)((size_t)func >> 3);
+    struct allocSite *site;
+    while(1) {
+        // The last slot is kept for "(other)", so the table proper is one smaller
+        site = &allocProf.sites[h % (KILO_ALLOC_SITES - 1)];
+        if(site->func == NULL) {
+            // Table full (bar one empty slot, so probing ends): count the rest under "(other)"
+            if(allocProf.nsites < KILO_ALLOC_SITES - 2) {
+                site->func = func;
+                site->line = line;
+                allocProf.nsites++;
+            } else {
+                site = &allocProf.sites[KILO_ALLOC_SITES - 1];
+            }
+            break;
+        }
+        if(site->func == func && site->line == line)
+            break;
+        h++;
+    }
+    site->calls++;
+    site->bytes += size;
+    allocProf.calls++;
+    allocProf.bytes += size;
+    allocProf.live += (long long)newsize - (long long)oldsize;
+    if(pthread_equal(pthread_self(), allocProf.main)) {
+        allocProf.main_calls++;
+        allocProf.main_bytes += size;
+    }
+    pthread_mutex_unlock(&allocLock);
+}
+
+void *allocMalloc(size_t size, const char *func, int line) {
+    void *p = malloc(size);
+    allocCount(size, 0, malloc_usable_size(p), func, line);
+    return p;
+}
+
+void *allocCalloc(size_t n, size_t size, const char *func, int line) {
+    void *p = calloc(n, size);
+    allocCount(n * size, 0, malloc_usable_size(p), func, line);
+    return p;
+}
+
+void *allocRealloc(void *old, size_t size, const char *func, int line) {
+    size_t oldsize = malloc_usable_size(old);
+    void *p = realloc(old, size);
+    allocCount(size, oldsize, malloc_usable_size(p), func, line);
+    return p;
+}
+
+char *allocStrdup(const char *s, const char *func, int line) {
+    char *p = strdup(s);
+    allocCount(strlen(s) + 1, 0, malloc_usable_size(p), func, line);
+    return p;
+}
+
+void allocFree(void *p) {
+    if(p == NULL)
+        return;
+    size_t size = malloc_usable_size(p);
+    pthread_mutex_lock(&allocLock);
+    allocProf.frees++;
+    allocProf.live -= size;
+    pthread_mutex_unlock(&allocLock);
+    free(p);
+}
+
+#define malloc(size) allocMalloc((size), __func__, __LINE__)
+#define calloc(n, size) allocCalloc((n), (size), __func__, __LINE__)
+#define realloc(p, size) allocRealloc((p), (size), __func__, __LINE__)
+#define strdup(s) allocStrdup((s), __func__, __LINE__)
+#define free(p) allocFree(p)
+
+void allocBegin(struct allocSpan *span) {
+    // Start a sample: note where the main thread's totals are
+    span->calls = allocProf.main_calls;
+    span->bytes = allocProf.main_bytes;
+}
+
+void allocEnd(struct allocSpan *span, int kind) {
+    // End a sample begun with allocBegin, adding it to the key or frame tally
+    struct allocTally *t = &allocProf.tally[kind];
+    long long calls = allocProf.main_calls - span->calls;
+    long long bytes = allocProf.main_bytes - span->bytes;
+    t->samples++;
+    t->calls += calls;
+    t->bytes += bytes;
+    if(calls > t->max_calls)
+        t->max_calls = calls;
+    if(bytes > t->max_bytes)
+        t->max_bytes = bytes;
+}
+
+int allocSiteCompare(const void *a, const void *b) {
+    // Most calls first
+    const struct allocSite *x = a, *y = b;
+    return (x->calls < y->calls) - (x->calls > y->calls);
+}
+
+void allocWrite(FILE *fp) {
+    // The report: calls and bytes per key and per frame, totals, then every call site, busiest first
+    const char *names[2] = {"key", "frame"};
+    fprintf(fp, "%-6s %8s %12s %10s %14s %10s\n", "per", "samples", "calls/mean", "calls/max", "bytes/mean",
+        "bytes/max");
+    for(int i = 0; i < 2; i++) {
+        struct allocTally *t = &allocProf.tally[i];
+        long long n = t->samples ? t->samples : 1;
+        fprintf(fp, "%-6s %8lld %12.1f %10lld %14.1f %10lld\n", names[i], t->samples, (double)t->calls / n,
+            t->max_calls, (double)t->bytes / n, t->max_bytes);
+    }
+    fprintf(fp, "total: %lld calls, %lld frees, %lld bytes asked for, %lld bytes live\n", allocProf.calls,
+        allocProf.frees, allocProf.bytes, allocProf.live);
+    struct allocSite sorted[KILO_ALLOC_SITES];
+    int n = 0;
+    for(int i = 0; i < KILO_ALLOC_SITES - 1; i++) {
+        if(allocProf.sites[i].func)
+            sorted[n++] = allocProf.sites[i];
+    }
+    // Calls from sites the table had no room for, always listed even if there were none
+    sorted[n] = allocProf.sites[KILO_ALLOC_SITES - 1];
+    sorted[n++].func = NULL;
+    qsort(sorted, n, sizeof(sorted[0]), allocSiteCompare);
+    fprintf(fp, "%12s %14s  %s\n", "calls", "bytes", "site");
+    for(int i = 0; i < n; i++) {
+        if(sorted[i].func)
+            fprintf(fp, "%12lld %14lld  %s:%d\n", sorted[i].calls, sorted[i].bytes, sorted[i].func, sorted[i].line);
+        else
+            fprintf(fp, "%12lld %14lld  (other)\n", sorted[i].calls, sorted[i].bytes);
+    }
+}
+
+void allocReport() {
+    // At exit: write the report out
+    FILE *fp = fopen(U.allocLog ? U.allocLog : "kilo-alloc.log", "w");
+    if(fp == NULL)
+        return;
+    allocWrite(fp);
+    fclose(fp);
+}
+
+void allocInit() {
+    // Samples are of the thread that calls this
+    allocProf.main = pthread_self();
+}
+#else
+void allocBegin(struct allocSpan *span) {
+    (void)span;
+}
+
+void allocEnd(struct allocSpan *span, int kind) {
+    (void)span;
+    (void)kind;
+}
+#endif
+
 /* Terminal */
 void die(const char *s) {
     /* Clear screen, print error message and exit */
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
 
+    // Whatever the journal has waiting still goes to disk
+    editorJournalFlush();
     perror(s);
     exit(1);
 }
 
 void disableRawMode() {
     /* Set termios config back to original */
+    // Turn bracketed paste back off too
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
         die("tcsetattr");
 }
@@ -257,15 +738,120 @@ void enableRawMode() {
     // TCSAFLUSH discards leftover bytes from input
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         die("tcsetattr");
+
+    // Bracketed paste: the terminal wraps pasted text in <esc>[200~ and <esc>[201~ so it can be inserted in one go
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+// Input read from the terminal but not handed out yet
+// Set by SIGHUP or SIGTERM, handled once nothing is half done
+volatile sig_atomic_t hangup = 0;
+
+struct inputBuffer {
+    char buf[4096];
+    int pos;
+    int len;
+};
+
+struct inputBuffer input = {{0}, 0, 0};
+
+void editorFeedInput(const char *s, int len) {
+    // Queue input as if it had been typed, for driving the editor without a terminal.  It has to fit in the buffer
+    if(input.pos > 0) {
+        memmove(input.buf, &input.buf[input.pos], input.len - input.pos);
+        input.len -= input.pos;
+        input.pos = 0;
+    }
+    if(len > (int)sizeof(input.buf) - input.len)
+        len = sizeof(input.buf) - input.len;
+    memcpy(&input.buf[input.len], s, len);
+    input.len += len;
+}
+
+int editorReadByte(char *c) {
+    // read one byte of input.  Whatever the terminal has ready is read at once and handed out a byte at a time,
+    // so a paste doesn't cost a system call per byte.  A background save gets the rows to itself while we wait
+    if(input.pos < input.len) {
+        *c = input.buf[input.pos++];
+        return 1;
+    }
+    // Nothing more is coming without a terminal, unless a replay has more
+    if(E.infd == -1) {
+        if(!editorReplayRead())
+            return 0;
+        *c = input.buf[input.pos++];
+        return 1;
+    }
+    struct saveJob *job = E.save;
+    if(job)
+        pthread_mutex_unlock(&job->lock);
+    int nread = read(E.infd, input.buf, sizeof(input.buf));
+    int saved = errno;
+    if(job)
+        pthread_mutex_lock(&job->lock);
+    if(hangup)
+        editorHangup();
+    errno = saved;
+    if(nread <= 0)
+        return nread;
+    editorRecordInput(input.buf, nread);
+    input.len = nread;
+    input.pos = 1;
+    *c = input.buf[0];
+    return 1;
+}
+
+char *editorReadPaste(int *len) {
+    // Read the text of a bracketed paste, after its start sequence, up to the <esc>[201~ that ends it.
+    // Gives up if the terminal goes quiet for a second without ending it
+    int cap = 4096;
+    char *buf = malloc(cap);
+    int n = 0;
+    int quiet = 0;
+    while(n < 6 || memcmp(&buf[n - 6], "\x1b[201~", 6)) {
+        char c;
+        int nread = editorReadByte(&c);
+        if(nread == -1 && errno != EAGAIN)
+            die("read");
+        if(nread != 1) {
+            if(++quiet == 10)
+                break;
+            continue;
+        }
+        quiet = 0;
+        if(n == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        buf[n++] = c;
+    }
+    if(n >= 6 && !memcmp(&buf[n - 6], "\x1b[201~", 6))
+        n -= 6;
+    // Line endings come back as \n, whether the terminal sent \r\n, \r or \n
+    int out = 0;
+    for(int j = 0; j < n; j++) {
+        if(buf[j] == '\r') {
+            buf[out++] = '\n';
+            if(j + 1 < n && buf[j + 1] == '\n')
+                j++;
+        } else {
+            buf[out++] = buf[j];
+        }
+    }
+    *len = out;
+    return buf;
 }
 
 int editorReadKey() {
     // Wait for a keypress and return it.  Low (terminal) level
     int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1){
-        if(nread == -1 && errno != EAGAIN)
+    // Sleep until there is input, doing deferred work meanwhile
+    editorWaitInput(-1);
+    while ((nread = editorReadByte(&c)) != 1){
+        if(nread == -1 && errno != EAGAIN && errno != EINTR)
             die("read");
+        editorWaitInput(-1);
     }
 
     // Escape sequences
@@ -273,32 +859,42 @@ int editorReadKey() {
         char seq[5];
 
         // Read 2 bytes.  If timeout, user pressed escape
-        if(read(STDIN_FILENO, &seq[0], 1) != 1)
+        if(editorReadByte(&seq[0]) != 1)
             return '\x1b';
-        if(read(STDIN_FILENO, &seq[1], 1) != 1)
+        if(editorReadByte(&seq[1]) != 1)
             return '\x1b';
 
         // [ means escape sequence
         if(seq[0] == '[') {
             // If it's a digit...
             if(seq[1] >= '0' && seq[1] <= '9') {
-                // Timeout, user pressed esc
-                if(read(STDIN_FILENO, &seq[2], 1) != 1)
-                    return '\x1b';
-                // Expect tilde after digit for page up/down
+                // Read the rest of the number, up to the byte after it
+                int num = seq[1] - '0';
+                while(1) {
+                    // Timeout, user pressed esc
+                    if(editorReadByte(&seq[2]) != 1)
+                        return '\x1b';
+                    if(seq[2] < '0' || seq[2] > '9' || num > 1000)
+                        break;
+                    num = num * 10 + (seq[2] - '0');
+                }
+                // Expect tilde after the number for page up/down
                 if(seq[2] == '~') {
-                    switch (seq[1]) {
+                    switch (num) {
                         // Home key + end key can have multiple escape sequences
                         // <esc>[~1 etc.
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
+                        case 1: return HOME_KEY;
+                        case 3: return DEL_KEY;
+                        case 4: return END_KEY;
+                        case 5: return PAGE_UP;
+                        case 6: return PAGE_DOWN;
+                        case 7: return HOME_KEY;
+                        case 8: return END_KEY;
+                        // <esc>[200~ starts a paste
+                        case 200: return PASTE_START;
                     }
-                } else if(seq[2] == ';' && seq[3] == '3') {
+                } else if(seq[2] == ';' && editorReadByte(&seq[3]) == 1 && editorReadByte(&seq[4]) == 1 &&
+                    seq[3] == '3') {
                     // ALT keypress
                     switch(seq[4]) {
                         case 'A':
@@ -382,25 +978,522 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
+/* Row tree */
+struct rowNode *rowNodeNew(int leaf) {
+    // Allocate an empty leaf or inner node
+    struct rowNode *node = malloc(sizeof(struct rowNode));
+    node->parent = NULL;
+    node->leaf = leaf;
+    node->n = 0;
+    node->numrows = 0;
+    node->numbytes = 0;
+    node->rows = leaf ? malloc(sizeof(erow) * ROW_LEAF_MAX) : NULL;
+    node->child = leaf ? NULL : malloc(sizeof(struct rowNode *) * ROW_NODE_MAX);
+    node->save_idx = -1;
+    return node;
+}
+
+void rowNodeFree(struct rowNode *node) {
+    free(node->rows);
+    free(node->child);
+    free(node);
+}
+
+int rowNodeIndex(struct rowNode *parent, struct rowNode *node) {
+    // Position of node among its parent's children
+    int j = 0;
+    while(parent->child[j] != node)
+        j++;
+    return j;
+}
+
+int editorNumRows() {
+    return E.rows->numrows;
+}
+
+struct rowNode *rowTreeFind(int *at) {
+    // Walk down to the leaf holding row *at, leaving *at as the index within that leaf.
+    // *at == number of rows finds the end of the last leaf
+    struct rowNode *node = E.rows;
+    while(!node->leaf) {
+        int j;
+        for(j = 0; j < node->n - 1; j++) {
+            if(*at < node->child[j]->numrows)
+                break;
+            *at -= node->child[j]->numrows;
+        }
+        node = node->child[j];
+    }
+    return node;
+}
+
+erow *editorRowAt(int at) {
+    // Get row at line at, or NULL if it is outside the file
+    if(at < 0 || at >= editorNumRows())
+        return NULL;
+    struct rowNode *leaf = rowTreeFind(&at);
+    return &leaf->rows[at];
+}
+
+int editorRowIndex(erow *row) {
+    // Line number of row: its place in its leaf plus every row in nodes to the left of the path up
+    struct rowNode *node = row->leaf;
+    int at = row - node->rows;
+    while(node->parent) {
+        struct rowNode *parent = node->parent;
+        for(int j = 0; parent->child[j] != node; j++) {
+            at += parent->child[j]->numrows;
+        }
+        node = parent;
+    }
+    return at;
+}
+
+erow *editorRowNext(erow *row) {
+    // Row after row, or NULL at the end of the file
+    struct rowNode *node = row->leaf;
+    if(row - node->rows + 1 < node->n)
+        return row + 1;
+    // Climb until there is a node to the right, then take its leftmost leaf
+    while(node->parent) {
+        struct rowNode *parent = node->parent;
+        int pos = rowNodeIndex(parent, node);
+        if(pos + 1 < parent->n) {
+            node = parent->child[pos + 1];
+            while(!node->leaf)
+                node = node->child[0];
+            return &node->rows[0];
+        }
+        node = parent;
+    }
+    return NULL;
+}
+
+erow *editorRowPrev(erow *row) {
+    // Row before row, or NULL at the start of the file
+    struct rowNode *node = row->leaf;
+    if(row > node->rows)
+        return row - 1;
+    while(node->parent) {
+        struct rowNode *parent = node->parent;
+        int pos = rowNodeIndex(parent, node);
+        if(pos > 0) {
+            node = parent->child[pos - 1];
+            while(!node->leaf)
+                node = node->child[node->n - 1];
+            return &node->rows[node->n - 1];
+        }
+        node = parent;
+    }
+    return NULL;
+}
+
+void rowTreeAdjust(struct rowNode *node, int rows, long long bytes) {
+    // Update totals from node up to the root
+    for(; node; node = node->parent) {
+        node->numrows += rows;
+        node->numbytes += bytes;
+    }
+}
+
+void rowNodeSplit(struct rowNode *node) {
+    // Move the upper half of a full node into a new sibling just after it
+    // Make room in the parent first so its totals stay correct
+    if(node->parent && node->parent->n == ROW_NODE_MAX)
+        rowNodeSplit(node->parent);
+
+    struct rowNode *sib = rowNodeNew(node->leaf);
+    int half = node->n / 2;
+    sib->n = node->n - half;
+    if(node->leaf) {
+        memcpy(sib->rows, &node->rows[half], sizeof(erow) * sib->n);
+        for(int j = 0; j < sib->n; j++) {
+            sib->rows[j].leaf = sib;
+            sib->numbytes += sib->rows[j].size + 1;
+        }
+        sib->numrows = sib->n;
+    } else {
+        memcpy(sib->child, &node->child[half], sizeof(struct rowNode *) * sib->n);
+        for(int j = 0; j < sib->n; j++) {
+            sib->child[j]->parent = sib;
+            sib->numrows += sib->child[j]->numrows;
+            sib->numbytes += sib->child[j]->numbytes;
+        }
+    }
+    node->n = half;
+    node->numrows -= sib->numrows;
+    node->numbytes -= sib->numbytes;
+
+    struct rowNode *parent = node->parent;
+    if(parent == NULL) {
+        // Splitting the root, the tree grows a level
+        parent = rowNodeNew(0);
+        parent->child[0] = node;
+        parent->n = 1;
+        parent->numrows = node->numrows + sib->numrows;
+        parent->numbytes = node->numbytes + sib->numbytes;
+        node->parent = parent;
+        E.rows = parent;
+    }
+    int pos = rowNodeIndex(parent, node) + 1;
+    memmove(&parent->child[pos + 1], &parent->child[pos], sizeof(struct rowNode *) * (parent->n - pos));
+    parent->child[pos] = sib;
+    parent->n++;
+    sib->parent = parent;
+}
+
+erow *rowTreeInsert(int at) {
+    // Open up an empty row at line at and return it.  Pointers to other rows may be invalidated
+    int i = at;
+    struct rowNode *leaf = rowTreeFind(&i);
+    editorSaveTouch(leaf);
+    if(leaf->n == ROW_LEAF_MAX) {
+        rowNodeSplit(leaf);
+        i = at;
+        leaf = rowTreeFind(&i);
+    }
+    memmove(&leaf->rows[i + 1], &leaf->rows[i], sizeof(erow) * (leaf->n - i));
+    leaf->n++;
+
+    erow *row = &leaf->rows[i];
+    row->leaf = leaf;
+    row->size = 0;
+    rowTreeAdjust(leaf, 1, 1);
+    return row;
+}
+
+void rowNodeAddSiblings(struct rowNode *node, struct rowNode **sibs, int m) {
+    // Link m new nodes in just after node, in order.  Their totals are their own and not yet counted above node.
+    // The parent is filled up first and whatever is left over goes into new parents, added after it the same way
+    struct rowNode *parent = node->parent;
+    if(parent == NULL) {
+        // Adding next to the root, the tree grows a level
+        parent = rowNodeNew(0);
+        parent->child[0] = node;
+        parent->n = 1;
+        parent->numrows = node->numrows;
+        parent->numbytes = node->numbytes;
+        node->parent = parent;
+        E.rows = parent;
+    }
+    int rows = 0;
+    long long bytes = 0;
+    for(int j = 0; j < m; j++) {
+        rows += sibs[j]->numrows;
+        bytes += sibs[j]->numbytes;
+    }
+    rowTreeAdjust(parent, rows, bytes);
+
+    int pos = rowNodeIndex(parent, node) + 1;
+    int t = parent->n - pos;
+    if(parent->n + m <= ROW_NODE_MAX) {
+        memmove(&parent->child[pos + m], &parent->child[pos], sizeof(struct rowNode *) * t);
+        memcpy(&parent->child[pos], sibs, sizeof(struct rowNode *) * m);
+        for(int j = 0; j < m; j++) {
+            sibs[j]->parent = parent;
+        }
+        parent->n += m;
+        return;
+    }
+
+    // The new nodes followed by the children already after node, filling parent then spread evenly over new parents
+    struct rowNode **all = malloc(sizeof(struct rowNode *) * (m + t));
+    memcpy(all, sibs, sizeof(struct rowNode *) * m);
+    memcpy(&all[m], &parent->child[pos], sizeof(struct rowNode *) * t);
+    int keep = ROW_NODE_MAX - pos;
+    for(int j = 0; j < keep; j++) {
+        parent->child[pos + j] = all[j];
+        all[j]->parent = parent;
+    }
+    parent->n = ROW_NODE_MAX;
+    int rest = m + t - keep;
+    int nnew = (rest + ROW_NODE_MAX - 1) / ROW_NODE_MAX;
+    struct rowNode **uncles = malloc(sizeof(struct rowNode *) * nnew);
+    int k = keep;
+    for(int j = 0; j < nnew; j++) {
+        struct rowNode *uncle = rowNodeNew(0);
+        int n = rest / nnew + (j < rest % nnew);
+        for(int c = 0; c < n; c++, k++) {
+            uncle->child[c] = all[k];
+            all[k]->parent = uncle;
+            uncle->numrows += all[k]->numrows;
+            uncle->numbytes += all[k]->numbytes;
+        }
+        uncle->n = n;
+        // Moved out from under parent, to be counted again when linked in next to it
+        rowTreeAdjust(parent, -uncle->numrows, -uncle->numbytes);
+        uncles[j] = uncle;
+    }
+    free(all);
+    rowNodeAddSiblings(parent, uncles, nnew);
+    free(uncles);
+}
+
+void rowTreeInsertRows(int at, erow *rows, int count) {
+    // Put count ready made rows into the tree at line at, in O(count + log n).  The leaf at line at is topped up
+    // and the rest are packed into full new leaves linked in together, rather than going in one row at a time
+    // and leaving every leaf they pass through split in half.  Pointers to other rows may be invalidated
+    int i = at;
+    struct rowNode *leaf = rowTreeFind(&i);
+    editorSaveTouch(leaf);
+    long long bytes = 0;
+    for(int j = 0; j < count; j++) {
+        bytes += rows[j].size + 1;
+    }
+    if(leaf->n + count <= ROW_LEAF_MAX) {
+        memmove(&leaf->rows[i + count], &leaf->rows[i], sizeof(erow) * (leaf->n - i));
+        memcpy(&leaf->rows[i], rows, sizeof(erow) * count);
+        for(int j = i; j < i + count; j++) {
+            leaf->rows[j].leaf = leaf;
+        }
+        leaf->n += count;
+        rowTreeAdjust(leaf, count, bytes);
+        return;
+    }
+
+    // The new rows followed by the rows already after line at, filling this leaf then spread evenly over new leaves
+    int t = leaf->n - i;
+    erow *tail = malloc(sizeof(erow) * t);
+    memcpy(tail, &leaf->rows[i], sizeof(erow) * t);
+    int total = count + t;
+    int keep = ROW_LEAF_MAX - i;
+    int rest = total - keep;
+    int nnew = (rest + ROW_LEAF_MAX - 1) / ROW_LEAF_MAX;
+    struct rowNode **sibs = malloc(sizeof(struct rowNode *) * nnew);
+    struct rowNode *node = leaf;
+    int n = ROW_LEAF_MAX;
+    int s = -1;
+    for(int k = 0, j = i; k < total; k++, j++) {
+        if(j == n) {
+            // This leaf is full, start the next new one
+            node = sibs[++s] = rowNodeNew(1);
+            n = rest / nnew + (s < rest % nnew);
+            j = 0;
+        }
+        erow *row = &node->rows[j];
+        *row = (k < count) ? rows[k] : tail[k - count];
+        row->leaf = node;
+        if(node != leaf) {
+            node->n++;
+            node->numrows++;
+            node->numbytes += row->size + 1;
+        }
+    }
+    free(tail);
+
+    // This leaf ends up full, having gained the rows its new neighbours didn't take from the tail
+    long long moved = 0;
+    for(int j = 0; j < nnew; j++) {
+        moved += sibs[j]->numbytes;
+    }
+    leaf->n = ROW_LEAF_MAX;
+    rowTreeAdjust(leaf, count - (total - keep), bytes - moved);
+    rowNodeAddSiblings(leaf, sibs, nnew);
+    free(sibs);
+}
+
+void rowNodeMove(struct rowNode *src, int from, struct rowNode *dst, int to, int n) {
+    // Move n rows (or children) from index from of src to index to of dst, its sibling, making room there and
+    // closing up behind them.  The totals of both are updated, and their parent's stay the same
+    int rows = 0;
+    long long bytes = 0;
+    if(src->leaf) {
+        for(int j = from; j < from + n; j++) {
+            rows++;
+            bytes += src->rows[j].size + 1;
+        }
+        memmove(&dst->rows[to + n], &dst->rows[to], sizeof(erow) * (dst->n - to));
+        memcpy(&dst->rows[to], &src->rows[from], sizeof(erow) * n);
+        memmove(&src->rows[from], &src->rows[from + n], sizeof(erow) * (src->n - from - n));
+        for(int j = to; j < to + n; j++) {
+            dst->rows[j].leaf = dst;
+        }
+    } else {
+        for(int j = from; j < from + n; j++) {
+            rows += src->child[j]->numrows;
+            bytes += src->child[j]->numbytes;
+        }
+        memmove(&dst->child[to + n], &dst->child[to], sizeof(struct rowNode *) * (dst->n - to));
+        memcpy(&dst->child[to], &src->child[from], sizeof(struct rowNode *) * n);
+        memmove(&src->child[from], &src->child[from + n], sizeof(struct rowNode *) * (src->n - from - n));
+        for(int j = to; j < to + n; j++) {
+            dst->child[j]->parent = dst;
+        }
+    }
+    src->n -= n;
+    dst->n += n;
+    src->numrows -= rows;
+    src->numbytes -= bytes;
+    dst->numrows += rows;
+    dst->numbytes += bytes;
+}
+
+void rowNodeRebalance(struct rowNode *node) {
+    // Called after rows have gone from node.  A node left under a quarter full is merged with a neighbour if
+    // they fit in one node, otherwise takes half the difference from it, so deleting most of a file doesn't
+    // leave a tree of near empty leaves.  Empty nodes are unlinked.  Either takes a child from the parent,
+    // which is then seen to the same way.  Rows may move to another leaf
+    while(node->parent) {
+        struct rowNode *parent = node->parent;
+        int max = node->leaf ? ROW_LEAF_MAX : ROW_NODE_MAX;
+        if(node->n >= max / 4)
+            return;
+        int pos = rowNodeIndex(parent, node);
+        if(node->n == 0) {
+            // Unlink nodes left empty
+            memmove(&parent->child[pos], &parent->child[pos + 1], sizeof(struct rowNode *) * (parent->n - pos - 1));
+            parent->n--;
+            rowNodeFree(node);
+            node = parent;
+            continue;
+        }
+        if(parent->n == 1) {
+            // No neighbour: the parent is as sparse, or is the root and goes when the tree is trimmed
+            node = parent;
+            continue;
+        }
+        // Pair node with the neighbour after it, or before it if it is the last child
+        if(pos == parent->n - 1)
+            pos--;
+        struct rowNode *left = parent->child[pos];
+        struct rowNode *right = parent->child[pos + 1];
+        // A running save may still need either as it was
+        editorSaveTouch(left);
+        editorSaveTouch(right);
+        if(left->n + right->n <= max) {
+            rowNodeMove(right, 0, left, left->n, right->n);
+            memmove(&parent->child[pos + 1], &parent->child[pos + 2], sizeof(struct rowNode *) * (parent->n - pos - 2));
+            parent->n--;
+            rowNodeFree(right);
+            node = parent;
+            continue;
+        }
+        int half = (left->n + right->n) / 2;
+        if(left->n < half)
+            rowNodeMove(right, 0, left, left->n, half - left->n);
+        else
+            rowNodeMove(left, half, right, 0, left->n - half);
+        return;
+    }
+}
+
+void rowTreeDelete(int at, int count) {
+    // Remove count rows from line at from the tree.  Their contents must already be freed.
+    // Each leaf the range covers loses its share in one go
+    while(count > 0) {
+        int i = at;
+        struct rowNode *node = rowTreeFind(&i);
+        editorSaveTouch(node);
+        int n = (count < node->n - i) ? count : node->n - i;
+        long long bytes = 0;
+        for(int j = i; j < i + n; j++) {
+            bytes += node->rows[j].size + 1;
+        }
+        rowTreeAdjust(node, -n, -bytes);
+        memmove(&node->rows[i], &node->rows[i + n], sizeof(erow) * (node->n - i - n));
+        node->n -= n;
+        count -= n;
+        rowNodeRebalance(node);
+    }
+    // Drop root levels with only one child (or none when the file is now empty)
+    while(!E.rows->leaf && E.rows->n <= 1) {
+        struct rowNode *root = E.rows;
+        E.rows = root->n ? root->child[0] : rowNodeNew(1);
+        E.rows->parent = NULL;
+        rowNodeFree(root);
+    }
+}
+
 /* Syntax highlighting */
 int is_separator(int c) {
-    // Identify spaces and punctuation etc.
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+    // Identify spaces and punctuation etc.  Looked up in a table built on first use
+    static unsigned char table[256];
+    static int built = 0;
+    if(!built) {
+        for(int j = 0; j < 256; j++) {
+            table[j] = isspace(j) || j == '\0' || strchr(",.()+-/*=~%<>[];", j) != NULL;
+        }
+        built = 1;
+    }
+    return table[(unsigned char)c];
+}
+
+unsigned int keywordHash(const char *s, int len) {
+    // FNV-1a hash of len bytes
+    unsigned int h = 2166136261u;
+    for(int j = 0; j < len; j++) {
+        h ^= (unsigned char)s[j];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void editorCompileKeywords(struct editorSyntax *syntax) {
+    // Build the keyword hash table for a syntax, working out keyword lengths and types once
+    int n = 0;
+    while(syntax->keywords[n])
+        n++;
+    // Keep the table at most half full so probes stay short
+    unsigned int size = 8;
+    while(size < (unsigned int)n * 2)
+        size <<= 1;
+
+    struct keywordTable *table = malloc(sizeof(struct keywordTable));
+    table->slots = calloc(size, sizeof(struct keywordEntry));
+    table->mask = size - 1;
+    table->maxlen = 0;
+    for(int j = 0; j < n; j++) {
+        char *kw = syntax->keywords[j];
+        int klen = strlen(kw);
+        // keyword2s are followed by a |.  Trim this off the length
+        int kw2 = kw[klen - 1] == '|';
+        if(kw2)
+            klen--;
+
+        // Linear probing: first free slot after the hash
+        unsigned int h = keywordHash(kw, klen) & table->mask;
+        while(table->slots[h].word)
+            h = (h + 1) & table->mask;
+        table->slots[h].word = kw;
+        table->slots[h].len = klen;
+        table->slots[h].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        if(klen > table->maxlen)
+            table->maxlen = klen;
+    }
+    syntax->kwtable = table;
+}
+
+int keywordLookup(struct keywordTable *table, const char *s, int len) {
+    // Highlight for word s, or HL_NORMAL if it isn't a keyword
+    if(len == 0 || len > table->maxlen)
+        return HL_NORMAL;
+    unsigned int h = keywordHash(s, len) & table->mask;
+    for(; table->slots[h].word; h = (h + 1) & table->mask) {
+        if(table->slots[h].len == len && !memcmp(table->slots[h].word, s, len))
+            return table->slots[h].hl;
+    }
+    return HL_NORMAL;
 }
 
-void editorUpdateSyntax(erow *row) {
-    // reallocate memory if row is new/bigger
-    row->hl = realloc(row->hl, row->rsize);
+void editorLexRun(const char *text, int len, unsigned char *hl, struct hlMark *st, int until) {
+    // Lex len characters of text into hl, carrying on from the state in st, until the first character at or
+    // past until (or the end).  st is left as the state there, with i set to len once the end is reached.
+    // hl before st->i must already be lexed, as the lexer looks back a character.  text need not be null terminated
+    if(until > len)
+        until = len;
     // Set all characters in hl to normal by default
-    memset(row->hl, HL_NORMAL, row->rsize);
+    if(until > st->i)
+        memset(&hl[st->i], HL_NORMAL, until - st->i);
 
     // Don't highlight no filetype specified
     if(E.syntax == NULL) {
+        st->i = len;
+        st->in_comment = 0;
         return;
     }
 
-    // Pointer to keywords array
-    char **keywords = E.syntax->keywords;
+    // Compiled keywords
+    struct keywordTable *kwtable = E.syntax->kwtable;
 
     // Get character to start singleline, multiline comment start and multiline comment end
     char *scs = E.syntax->singleline_comment_start;
@@ -412,28 +1505,27 @@ void editorUpdateSyntax(erow *row) {
     int mce_len = mcs ? strlen(mce) : 0;
 
     // Keep track of whether the previous character was a separator. 1 = true
-    int prev_sep = 1;
+    int prev_sep = st->prev_sep;
     // Keep track of whether we're in a string
-    int in_string = 0;
-    // Keep track of whether we're in a multiline comment (true if previous row has unclosed multiline comment)
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+    int in_string = st->in_string;
+    int in_comment = st->in_comment;
 
     // Loop through charaters and set to those appropriate from enum
-    int i = 0;
-    while(i < row->rsize) {
+    int i = st->i;
+    while(i < until) {
         // Get character
-        char c = row->render[i];
+        char c = text[i];
         // Get previous highlight code
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
 
         // Check if there is a comment start and we aren't in a string
         if (scs_len && !in_string && !in_comment) {
             // Check if the characters match the start of a single line comment            
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                editorSetStatusMessage("highlightin'");
+            if (i + scs_len <= len && !memcmp(&text[i], scs, scs_len)) {
                 // Highlight                
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+                memset(&hl[i], HL_COMMENT, len - i);
                 // Break, we are done with this line                
+                i = len;
                 break;
             }
         }
@@ -442,9 +1534,9 @@ void editorUpdateSyntax(erow *row) {
         if(mcs_len && mce_len && !in_string) {
             if(in_comment) {
                 // Highlight comment
-                row->hl[i] = HL_MLCOMMENT;
-                if(!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+                hl[i] = HL_MLCOMMENT;
+                if(i + mce_len <= len && !memcmp(&text[i], mce, mce_len)) {
+                    memset(&hl[i], HL_MLCOMMENT, mce_len);
                     i += mce_len;
                     in_comment = 0;
                     prev_sep = 1;
@@ -453,9 +1545,9 @@ void editorUpdateSyntax(erow *row) {
                     i++;
                     continue;
                 }
-            } else if(!strncmp(&row->render[i], mcs, mcs_len)) {
+            } else if(i + mcs_len <= len && !memcmp(&text[i], mcs, mcs_len)) {
                 // Start of multiline comment: highlight whole comment
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+                memset(&hl[i], HL_MLCOMMENT, mcs_len);
                 i += mcs_len;
                 in_comment = 1;
                 continue;
@@ -467,10 +1559,10 @@ void editorUpdateSyntax(erow *row) {
             // If this is set, highlight current char with HL_STRING
             if(in_string) {
                 // Set highlight to string
-                row->hl[i] = HL_STRING;
+                hl[i] = HL_STRING;
                 // Deal with \ escapes in strings
-                if(c == '\\' && i + 1 < row->size) {
-                    row->hl[i + 1] = HL_STRING;
+                if(c == '\\' && i + 1 < len) {
+                    hl[i + 1] = HL_STRING;
                     i += 2;
                     continue;
                 }
@@ -489,7 +1581,7 @@ void editorUpdateSyntax(erow *row) {
                 if(c == '"' || c== '\'') {
                     // Make sure we know which we are in
                     in_string = c;
-                    row->hl[i] = HL_STRING;
+                    hl[i] = HL_STRING;
                     i++;
                     continue;
                 }
@@ -500,7 +1592,7 @@ void editorUpdateSyntax(erow *row) {
         if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
             // Highlight as a number if previous character was a separator or number (Make sure numbers with decimals are also highlighted)
             if((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
+                hl[i] = HL_NUMBER;
                 i++;
                 // We are in the middle of highlighting something...
                 prev_sep = 0;
@@ -510,26 +1602,15 @@ void editorUpdateSyntax(erow *row) {
 
         // Highlight keywords if they are after a separator
         if(prev_sep) {
-            // Loop through all keywords to see if they appear
-            int j;
-            for(j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                // keyword2s are followed by a |.  Trim this off the length
-                int kw2 = keywords[j][klen - 1] == '|';
-                if(kw2) {
-                    klen--;
-                }
-
-                // Check if keyword appears at current point in text and f it is followed by a separator
-                if(!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i + klen])) {
-                    // highlight the whole keyword, consume
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-
-            if(keywords[j] != NULL) {
+            // Find the end of the word (no further than the longest keyword) and look it up
+            int wlen = 0;
+            while(i + wlen < len && wlen <= kwtable->maxlen && !is_separator(text[i + wlen]))
+                wlen++;
+            int kw = keywordLookup(kwtable, &text[i], wlen);
+            if(kw != HL_NORMAL) {
+                // highlight the whole keyword, consume
+                memset(&hl[i], kw, wlen);
+                i += wlen;
                 prev_sep = 0;
                 continue;
             }
@@ -538,12 +1619,220 @@ void editorUpdateSyntax(erow *row) {
         prev_sep = is_separator(c);
         i++;
     }
-    // Set in_comment after processing row
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if(changed && row->idx + 1 < E.numrows) {
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+    st->i = i;
+    st->in_comment = in_comment;
+    st->in_string = in_string;
+    st->prev_sep = prev_sep;
+}
+
+int editorHighlight(char *text, int len, unsigned char *hl, int in_comment) {
+    // Lex len characters of text into hl, starting inside a multiline comment if in_comment.
+    // Returns whether a multiline comment is still open at the end
+    struct hlMark st = {0, in_comment, 0, 1, HL_NORMAL};
+    editorLexRun(text, len, hl, &st, len);
+    return st.in_comment;
+}
+
+int editorLexAhead() {
+    // Furthest past where it is that the lexer looks at the text, so marks at least this far before an edit
+    // weren't affected by it
+    struct editorSyntax *syn = E.syntax;
+    int ahead = syn->kwtable->maxlen + 1;
+    const char *delims[3] = {syn->singleline_comment_start, syn->multiline_comment_start, syn->multiline_comment_end};
+    for(int j = 0; j < 3; j++) {
+        if(delims[j] && (int)strlen(delims[j]) > ahead)
+            ahead = strlen(delims[j]);
+    }
+    return ahead + 1;
+}
+
+void editorMarkAdd(struct hlMarks **marks, struct hlMark *m) {
+    // Append m to a list of marks, starting one if *marks is NULL
+    if(*marks == NULL) {
+        *marks = malloc(sizeof(struct hlMarks) + sizeof(struct hlMark) * 16);
+        (*marks)->n = 0;
+        (*marks)->cap = 16;
+    } else if((*marks)->n == (*marks)->cap) {
+        (*marks)->cap *= 2;
+        *marks = realloc(*marks, sizeof(struct hlMarks) + sizeof(struct hlMark) * (*marks)->cap);
+    }
+    (*marks)->m[(*marks)->n++] = *m;
+}
+
+int editorHighlightRow(erow *row, int in_comment) {
+    // Lex row's render into hl, starting inside a multiline comment if in_comment, and return the state at the
+    // end.  Only the part an edit changed is lexed: from the last mark far enough before it, up to the first mark
+    // after it where the lexer is in the same state as last time, as from there on nothing it does can differ
+    int len = row->rsize;
+    int from = row->hl_from, to = row->hl_to;
+    row->hl_from = -1;
+    row->hl_to = 0;
+    if(from < 0)
+        return row->hl_open_comment;
+    if(to == ROW_HL_ALL)
+        from = 0;
+    if(E.syntax == NULL) {
+        // Everything is normal, so only the changed part needs setting
+        if(to > len)
+            to = len;
+        memset(&row->hl[from], HL_NORMAL, to - from);
+        return 0;
+    }
+    if(len <= KILO_HL_MARK) {
+        free(row->marks);
+        row->marks = NULL;
+        return editorHighlight(row->render, len, row->hl, in_comment);
+    }
+
+    struct hlMarks *old = row->marks;
+    struct hlMarks *marks = NULL;
+    struct hlMark st = {0, in_comment, 0, 1, HL_NORMAL};
+    int j = 0;
+    if(to != ROW_HL_ALL && old) {
+        // Keep the marks before from, and start at the last of them
+        int ahead = editorLexAhead();
+        while(j < old->n && old->m[j].i + ahead <= from) {
+            editorMarkAdd(&marks, &old->m[j]);
+            st = old->m[j++];
+        }
+    }
+    int last = st.i;
+    int end = -1;
+    while(st.i < len) {
+        // Run to the next mark, or to an old mark past the change sooner than that
+        while(old && j < old->n && old->m[j].i < st.i)
+            j++;
+        int until = last + KILO_HL_MARK;
+        if(old && j < old->n && old->m[j].i >= to && old->m[j].i < until)
+            until = old->m[j].i;
+        editorLexRun(row->render, len, row->hl, &st, until);
+        if(st.i >= len)
+            break;
+        st.prev_hl = row->hl[st.i - 1];
+        while(old && j < old->n && old->m[j].i < st.i)
+            j++;
+        if(old && j < old->n && old->m[j].i == st.i && st.i >= to && old->m[j].in_comment == st.in_comment &&
+            old->m[j].in_string == st.in_string && old->m[j].prev_sep == st.prev_sep &&
+            old->m[j].prev_hl == st.prev_hl) {
+            // Back in step: the rest of hl, its marks and the end state are as they were
+            for(; j < old->n; j++) {
+                editorMarkAdd(&marks, &old->m[j]);
+            }
+            end = row->hl_open_comment;
+            break;
+        }
+        editorMarkAdd(&marks, &st);
+        last = st.i;
+    }
+    free(old);
+    row->marks = marks;
+    return (end >= 0) ? end : st.in_comment;
+}
+
+void editorUpdateSyntax(erow *row, int full) {
+    // Re-lex row starting from the end state of the row before it, which must be up to date.
+    // full fills in hl for display, otherwise only the end state is worked out, without rendering a row that
+    // hasn't been drawn yet.  A rendered row is lexed into hl either way, as only what changed needs doing
+    static unsigned char *scratch = NULL;
+    static char *text = NULL;
+    static int scratchlen = 0;
+
+    erow *prev = editorRowPrev(row);
+    int in_comment = (prev && prev->hl_open_comment);
+    int end;
+    if(row->flags & ROW_STALE_STATE)
+        E.hl_pending--;
+    if(full || !(row->flags & ROW_STALE_RENDER)) {
+        editorRowRender(row);
+        end = editorHighlightRow(row, in_comment);
+        row->flags &= ~(ROW_STALE_STATE | ROW_STALE_HL);
+    } else {
+        // Tabs don't change where strings and comments start, so the raw text will do.  Text split by the gap
+        // is copied out rather than moving the gap away from where it is being edited
+        if(scratchlen < row->size) {
+            scratchlen = row->size;
+            scratch = realloc(scratch, scratchlen);
+            text = realloc(text, scratchlen);
+        }
+        char *chars = row->chars;
+        if(row->gap < row->size && row->gaplen > 0) {
+            memcpy(text, row->chars, row->gap);
+            memcpy(&text[row->gap], &row->chars[row->gap + row->gaplen], row->size - row->gap);
+            chars = text;
+        }
+        end = editorHighlight(chars, row->size, scratch, in_comment);
+        row->flags &= ~ROW_STALE_STATE;
+    }
+
+    // If the row now ends in a different state, the next row has to be lexed again.
+    // Otherwise the change stops here
+    if(row->hl_open_comment != end) {
+        row->hl_open_comment = end;
+        erow *next = editorRowNext(row);
+        if(next)
+            editorMarkStale(next);
+    }
+}
+
+void editorFlagStale(erow *row) {
+    // Row must be lexed again.  Count it so idle time knows there is work left
+    if(!(row->flags & ROW_STALE_STATE))
+        E.hl_pending++;
+    row->flags |= ROW_STALE_STATE | ROW_STALE_HL;
+}
+
+void editorMarkStale(erow *row) {
+    // Row must be lexed again from the start, as the state it starts in may have changed
+    editorFlagStale(row);
+    row->hl_from = 0;
+    row->hl_to = ROW_HL_ALL;
+}
+
+void editorInvalidateRow(erow *row) {
+    // Row text changed: highlight it again before it is next drawn.  editorUpdateRowFrom has noted which part
+    editorFlagStale(row);
+    int at = editorRowIndex(row);
+    if(at < E.hl_stale_from)
+        E.hl_stale_from = at;
+    editorMatchRowChanged(at);
+    editorChunkRowChanged(at);
+}
+
+void editorSyncSyntax(int from, int to) {
+    // Bring rows from..to-1 up to date so they can be drawn.  Rows above from are not touched: if they
+    // haven't been lexed yet the state cached on the row above is used for now, and idle time fixes it later
+    if(to > editorNumRows())
+        to = editorNumRows();
+    erow *row = editorRowAt(from);
+    for(int j = from; row && j < to; j++, row = editorRowNext(row)) {
+        if(row->flags & (ROW_STALE_STATE | ROW_STALE_HL))
+            editorUpdateSyntax(row, 1);
+    }
+    // If the rows above were right, so are these now
+    if(E.hl_stale_from >= from && E.hl_stale_from < to)
+        E.hl_stale_from = to;
+}
+
+int editorSyntaxIdle(int budget) {
+    // Walk up to budget rows from the first stale one, lexing any that are flagged.  Off screen rows only
+    // get their end state worked out.  Returns 1 if a row on screen changed and needs drawing again
+    int redraw = 0;
+    int j = E.hl_stale_from;
+    erow *row = editorRowAt(j);
+    for(; row && budget > 0; j++, budget--, row = editorRowNext(row)) {
+        if(!(row->flags & ROW_STALE_STATE))
+            continue;
+        int visible = (j >= E.rowoff && j < E.rowoff + E.screenrows);
+        editorUpdateSyntax(row, visible);
+        redraw |= visible;
+    }
+    E.hl_stale_from = j;
+    if(row == NULL) {
+        // Reached the end, everything has been lexed
+        E.hl_stale_from = editorNumRows();
+        E.hl_pending = 0;
     }
+    return redraw;
 }
 
 int editorSyntaxToColour(int hl) {
@@ -594,11 +1883,14 @@ void editorSelectSyntaxHighlight() {
             if((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
                 (!is_ext && strstr(E.filename, s->filematch[i]))) {
                     E.syntax = s;
-                    // Rehighlight file when type changes
-                    int filerow;
-                    for(filerow = 0; filerow < E.numrows; filerow++) {
-                        editorUpdateSyntax(&E.row[filerow]);
+                    if(s->kwtable == NULL)
+                        editorCompileKeywords(s);
+                    // Rehighlight file when type changes, as rows are drawn
+                    erow *row;
+                    for(row = editorRowAt(0); row; row = editorRowNext(row)) {
+                        editorMarkStale(row);
                     }
+                    E.hl_stale_from = 0;
                     return;
                 }
             i++;
@@ -607,444 +1899,4205 @@ void editorSelectSyntaxHighlight() {
 }
 
 /* Row operations */
-void editorUpdateRow(erow *row) {
-    // Allocate memory then copy row contents
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++) { 
-        if (row->chars[j] == '\t') tabs++;
+int editorCountByte(const char *s, int len, char c) {
+    // Count the bytes equal to c, comparing a whole vector at a time where the CPU allows
+    int n = 0;
+    int j = 0;
+#if defined(__AVX2__)
+    __m256i needle = _mm256_set1_epi8(c);
+    for(; j + 32 <= len; j += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&s[j]);
+        n += __builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle)));
     }
+#elif defined(__SSE2__)
+    __m128i needle = _mm_set1_epi8(c);
+    for(; j + 16 <= len; j += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&s[j]);
+        n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)));
+    }
+#endif
+    // Whatever is left over (or everything, without vectors)
+    for(; j < len; j++) {
+        if(s[j] == c) n++;
+    }
+    return n;
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(U.tabNo - 1) + 1);
-
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-
-            while (idx % U.tabNo != 0) {
-                row->render[idx++] = ' ';
-            }
-        } else {
-            row->render[idx++] = row->chars[j];
-        }
+int editorRowTabs(erow *row) {
+    // Number of tabs in row, counted the first time it is needed.  The text either side of the gap is counted separately
+    if(row->tabs < 0) {
+        row->tabs = editorCountByte(row->chars, row->gap, '\t') +
+            editorCountByte(&row->chars[row->gap + row->gaplen], row->size - row->gap, '\t');
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    return row->tabs;
+}
 
-    // Update syntax highlighting
-    editorUpdateSyntax(row); 
+int editorExpandTabs(char *dst, int idx, const char *src, int len) {
+    // Copy len bytes of src into dst at render position idx, turning tabs into spaces up to the next tab stop.
+    // memchr and memcpy skip from tab to tab a vector at a time instead of copying byte by byte.  Returns the new idx
+    while(len > 0) {
+        const char *tab = memchr(src, '\t', len);
+        int run = tab ? tab - src : len;
+        memcpy(&dst[idx], src, run);
+        idx += run;
+        if(tab == NULL)
+            break;
+        int stop = idx + U.tabNo - idx % U.tabNo;
+        memset(&dst[idx], ' ', stop - idx);
+        idx = stop;
+        src += run + 1;
+        len -= run + 1;
+    }
+    return idx;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    // Validate at is within the file
-    if(at < 0 || at > E.numrows)
+int editorTextColumn(const char *s, int len, int rx) {
+    // Render column reached by len bytes of s starting at column rx, skipping from tab to tab with memchr
+    while(len > 0) {
+        const char *tab = memchr(s, '\t', len);
+        if(tab == NULL)
+            return rx + len;
+        rx += tab - s;
+        rx += U.tabNo - rx % U.tabNo;
+        len -= tab - s + 1;
+        s = tab + 1;
+    }
+    return rx;
+}
+
+int editorRowColumn(erow *row, int from, int to, int rx) {
+    // Render column reached by chars from..to-1 of row starting at column rx, either side of the gap
+    if(editorRowTabs(row) == 0)
+        return rx + to - from;
+    if(from < row->gap)
+        rx = editorTextColumn(&row->chars[from], ((to < row->gap) ? to : row->gap) - from, rx);
+    if(to > row->gap) {
+        int start = (from > row->gap) ? from : row->gap;
+        rx = editorTextColumn(&row->chars[start + row->gaplen], to - start, rx);
+    }
+    return rx;
+}
+
+int editorRowCxToRx(erow *row, int cx) {
+    // Without tabs render and chars line up
+    return editorRowColumn(row, 0, cx, 0);
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+    if(editorRowTabs(row) == 0)
+        return rx < row->size ? rx : row->size;
+    int cur_rx = 0;
+    int cx;
+    for(cx = 0; cx < row->size; cx++) {
+        // Translate tabs into spaces
+        if(ROW_CHAR(row, cx) == '\t')
+            cur_rx += (U.tabNo - 1) - (cur_rx % U.tabNo);
+        cur_rx++;
+
+        // Once cur_rx hits the end of the rendered line, return the cx value
+        if(cur_rx > rx)
+            return cx;
+    }
+    return cx;
+}
+
+int editorRowExpand(erow *row, int idx, int from, int to) {
+    // Expand chars from..to-1 into render at column idx, the text before the gap and then the text after it.
+    // Returns the column after them
+    if(from < row->gap)
+        idx = editorExpandTabs(row->render, idx, &row->chars[from], ((to < row->gap) ? to : row->gap) - from);
+    if(to > row->gap) {
+        int start = (from > row->gap) ? from : row->gap;
+        idx = editorExpandTabs(row->render, idx, &row->chars[start + row->gaplen], to - start);
+    }
+    return idx;
+}
+
+void editorRowGrowRender(erow *row, int need, int shared) {
+    // Make room for need bytes of render (unless it is shared) and hl.  They grow geometrically so typing
+    // doesn't realloc on every key
+    if(need <= row->rcap)
+        return;
+    row->rcap = (need > row->rcap * 2) ? need : row->rcap * 2;
+    if(!shared)
+        row->render = realloc(row->render, row->rcap);
+    row->hl = realloc(row->hl, row->rcap);
+}
+
+void editorUpdateRowFrom(erow *row, int at, int len, const char *del, int dellen) {
+    // chars at..at+len-1 have just replaced the dellen bytes at del.  The render and hl of the text after them
+    // haven't changed, only moved, so they are shifted along and only the new text is expanded, with the text
+    // up to the next tab, whose width may have changed.  Rows that haven't been drawn yet are rendered in full
+    // when they are
+    if(row->flags & ROW_STALE_RENDER)
         return;
 
-    // Allocate memory for line length and copy text to the row.  Append row to the rows array
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+    // Render columns of the edit, and of the unchanged text after it before and after the edit.  Past the next
+    // tab that text is at a tab stop either way, so it only needs moving
+    int rx = editorRowCxToRx(row, at);
+    int end = editorRowColumn(row, at, at + len, rx);
+    int oldtail, tail, stop;
+    if(at + len == row->size) {
+        // Nothing after the edit
+        oldtail = row->rsize;
+        tail = end;
+        stop = at + len;
+    } else {
+        int oldend = editorTextColumn(del, dellen, rx);
+        int t = -1;
+        if(editorRowTabs(row) > 0) {
+            // First tab after the edit, either side of the gap
+            int from = at + len;
+            const char *tab = NULL;
+            if(from < row->gap)
+                tab = memchr(&row->chars[from], '\t', row->gap - from);
+            if(tab) {
+                t = tab - row->chars;
+            } else {
+                int start = (from > row->gap) ? from : row->gap;
+                tab = memchr(&row->chars[start + row->gaplen], '\t', row->size - start);
+                if(tab)
+                    t = tab - row->chars - row->gaplen;
+            }
+        }
+        if(t < 0) {
+            oldtail = oldend;
+            tail = end;
+            stop = at + len;
+        } else {
+            int n = t - at - len;
+            oldtail = oldend + n + U.tabNo - (oldend + n) % U.tabNo;
+            tail = end + n + U.tabNo - (end + n) % U.tabNo;
+            stop = t + 1;
+        }
+    }
+    int shift = tail - oldtail;
+    int rsize = row->rsize + shift;
+
+    // A tab-free row whose text is in one piece keeps rendering as itself.  Otherwise a shared render becomes a
+    // copy of its own, once, and owned renders stay owned until the row is rendered from scratch
+    int contiguous = (row->gaplen == 0 || row->gap == row->size);
+    int shared = (row->flags & ROW_SHARED_RENDER) && editorRowTabs(row) == 0 && contiguous;
+    editorRowGrowRender(row, rsize + 1, row->flags & ROW_SHARED_RENDER);
+    if(row->rsize > oldtail)
+        memmove(&row->hl[tail], &row->hl[oldtail], row->rsize - oldtail);
+    if(shared) {
+        row->render = row->chars;
+    } else if(row->flags & ROW_SHARED_RENDER) {
+        row->flags &= ~ROW_SHARED_RENDER;
+        row->render = malloc(row->rcap);
+        rsize = editorRowExpand(row, 0, 0, row->size);
+        row->render[rsize] = '\0';
+    } else {
+        if(row->rsize > oldtail)
+            memmove(&row->render[tail], &row->render[oldtail], row->rsize - oldtail);
+        editorRowExpand(row, rx, at, stop);
+        row->render[rsize] = '\0';
+    }
+    row->rsize = rsize;
+
+    // Marks in the replaced text are dropped and those after it move along with it
+    if(row->marks) {
+        int n = 0;
+        for(int j = 0; j < row->marks->n; j++) {
+            struct hlMark m = row->marks->m[j];
+            if(m.i >= rx && m.i < oldtail)
+                continue;
+            if(m.i >= oldtail)
+                m.i += shift;
+            row->marks->m[n++] = m;
+        }
+        row->marks->n = n;
+    }
+    // Add rx..tail to the part of hl to lex again, moving the end of what was there already
+    if(row->hl_to != ROW_HL_ALL) {
+        if(row->hl_from < 0) {
+            row->hl_from = rx;
+            row->hl_to = tail;
+        } else {
+            int to = row->hl_to;
+            if(to >= oldtail)
+                to += shift;
+            else if(to > rx)
+                to = tail;
+            if(rx < row->hl_from)
+                row->hl_from = rx;
+            row->hl_to = (to > tail) ? to : tail;
+        }
+    }
+}
 
-    // Update index of row on insert
-    for(int j = at + 1; j <= E.numrows; j++) {
-        E.row[j].idx++;
+void editorRowRender(erow *row) {
+    // Build render for a row about to be shown or searched, if it is out of date
+    if(!(row->flags & ROW_STALE_RENDER))
+        return;
+    row->flags &= ~ROW_STALE_RENDER;
+    // A row without tabs renders as itself, so if its text is in one piece render can just point at it
+    int contiguous = (row->gaplen == 0 || row->gap == row->size);
+    if(editorRowTabs(row) == 0 && contiguous) {
+        if(!(row->flags & ROW_SHARED_RENDER))
+            free(row->render);
+        row->flags |= ROW_SHARED_RENDER;
+        row->render = row->chars;
+        row->rsize = row->size;
+        // hl is still needed
+        editorRowGrowRender(row, row->size + 1, 1);
+        return;
     }
+    if(row->flags & ROW_SHARED_RENDER) {
+        row->flags &= ~ROW_SHARED_RENDER;
+        row->render = NULL;
+        row->rcap = 0;
+    }
+    editorRowGrowRender(row, editorRowColumn(row, 0, row->size, 0) + 1, 0);
+    row->rsize = editorRowExpand(row, 0, 0, row->size);
+    row->render[row->rsize] = '\0';
+}
 
-    // Assign row its index
-    E.row[at].idx = at;
+void editorRowInit(erow *row, char *chars, size_t len, int flags) {
+    // Fill in a new row using chars as its text: either a heap buffer it now owns, or a pointer into the map.
+    // The row's place in the tree is left to the caller
+    row->size = len;
+    row->chars = chars;
+    row->gap = len;
+    row->gaplen = 0;
+    row->tabs = -1;
+
+    // Nothing is rendered or highlighted until the row is drawn
+    row->rsize = 0;
+    row->rcap = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hl_open_comment = 0;
+    row->marks = NULL;
+    row->flags = flags | ROW_STALE_RENDER;
+    editorMarkStale(row);
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+erow *editorNewRow(int at, char *chars, size_t len, int flags) {
+    // Put a row into the tree using chars as its text, see editorRowInit.  The rows around it, the match list
+    // and dirty count are left to the caller
+    erow *row = rowTreeInsert(at);
+    editorRowInit(row, chars, len, flags);
+    rowTreeAdjust(row->leaf, 0, len);
+    return row;
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+erow *editorInsertRowText(int at, char *chars, size_t len, int flags) {
+    // Insert a row using chars as its text, see editorNewRow
+    erow *row = editorNewRow(at, chars, len, flags);
+    // The row after now follows a different row, so lex it again too
+    erow *next = editorRowNext(row);
+    if(next)
+        editorMarkStale(next);
+    if(at < E.hl_stale_from)
+        E.hl_stale_from = at;
+    editorMatchRowsInserted(at, 1);
+    editorChunkRowsInserted(at, 1);
 
-    E.numrows++;
     E.dirty++;
+    return row;
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+void editorInsertRow(int at, char *s, size_t len) {
+    // Validate at is within the file
+    if(at < 0 || at > editorNumRows())
+        return;
+
+    // Allocate memory for line length and copy text to the row
+    char *chars = malloc(len + 1);
+    memcpy(chars, s, len);
+    editorInsertRowText(at, chars, len, 0);
 }
 
-void editorDelRow(int at) {
-    // Make sure at is valid (in the file)
-    if(at < 0 || at >= E.numrows)
+void editorInsertMappedRow(int at, char *s, size_t len) {
+    // Same as editorInsertRow, but the row text is left in the original file buffer instead of being copied
+    if(at < 0 || at > editorNumRows())
+        return;
+
+    // No copy and no null byte - the text is only valid for size bytes
+    editorInsertRowText(at, s, len, ROW_MAPPED);
+}
+
+void editorRowDetach(erow *row) {
+    // Copy a row out of the original file buffer before it is modified, leaving a gap at the end
+    if(!(row->flags & ROW_MAPPED))
         return;
-    // Free memory and remove element from the array
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+    char *chars = malloc(row->size + ROW_GAP_MIN);
+    memcpy(chars, row->chars, row->size);
+    row->chars = chars;
+    row->gap = row->size;
+    row->gaplen = ROW_GAP_MIN;
+    row->flags &= ~ROW_MAPPED;
+    // Keep a shared render pointing at the text
+    if(row->flags & ROW_SHARED_RENDER)
+        row->render = row->chars;
+}
 
-    // Update index of row on delete
-    for(int j = at; j < E.numrows - 1; j++) {
-        E.row[j].idx--;
+void editorRowMoveGap(erow *row, int at) {
+    // Move the gap to chars index at, shifting only the text between the old and new positions
+    if(row->gaplen == 0) {
+        // Nothing to move (and mapped rows must not be written to)
+        row->gap = at;
+        return;
+    }
+    if(at < row->gap) {
+        memmove(&row->chars[at + row->gaplen], &row->chars[at], row->gap - at);
+    } else if(at > row->gap) {
+        memmove(&row->chars[row->gap], &row->chars[row->gap + row->gaplen], at - row->gap);
     }
+    row->gap = at;
+}
+
+void editorRowGrowGap(erow *row, int need) {
+    // Make sure the gap can take need more characters.  The buffer doubles so edits stay O(1) amortized
+    if(row->gaplen >= need)
+        return;
+    int cap = row->size + row->gaplen;
+    int newcap = cap * 2;
+    if(newcap < row->size + need + ROW_GAP_MIN)
+        newcap = row->size + need + ROW_GAP_MIN;
+    row->chars = realloc(row->chars, newcap);
+    // Move the text after the gap to the end of the bigger buffer
+    int tail = row->size - row->gap;
+    memmove(&row->chars[newcap - tail], &row->chars[row->gap + row->gaplen], tail);
+    row->gaplen = newcap - row->size;
+}
+
+char *editorRowText(erow *row) {
+    // Close the gap so the row is contiguous, for code that needs the whole line at once
+    editorRowMoveGap(row, row->size);
+    return row->chars;
+}
+
+void editorFreeRow(erow *row) {
+    if(!(row->flags & ROW_SHARED_RENDER))
+        free(row->render);
+    // Mapped rows don't own their text
+    if(!(row->flags & ROW_MAPPED))
+        free(row->chars);
+    free(row->hl);
+    free(row->marks);
+}
 
-    E.numrows--;
+void editorDeleteRows(int at, int count) {
+    // Make sure the rows are valid (in the file)
+    if(at < 0 || count <= 0 || at + count > editorNumRows())
+        return;
+    // Free memory and remove the rows from the tree
+    erow *row = editorRowAt(at);
+    for(int j = 0; j < count; j++) {
+        erow *next = editorRowNext(row);
+        if(row->flags & ROW_STALE_STATE)
+            E.hl_pending--;
+        // A running save may still need the text
+        editorSaveTouch(row->leaf);
+        editorFreeRow(row);
+        row = next;
+    }
+    rowTreeDelete(at, count);
+    // The row that moves up follows a different row now
+    erow *next = editorRowAt(at);
+    if(next)
+        editorMarkStale(next);
+    if(at < E.hl_stale_from)
+        E.hl_stale_from = at;
+    editorMatchRowsDeleted(at, count);
+    editorChunkRowsDeleted(at, count);
     E.dirty++;
 }
 
+void editorDelRow(int at) {
+    editorDeleteRows(at, 1);
+}
+
 void editorRowInsertChar(erow *row, int at, int c) {
     // Validate at is within the length of the line or 1 over (at the end)
     // at is index to insert character at
     if(at < 0 || at > row->size) {
         at = row -> size;
     }
-    // Make space for extra character and NULL byte
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    // Increment size and add character
+    editorSaveTouch(row->leaf);
+    editorRowDetach(row);
+    // Move the gap to the insert point and make sure there is room in it
+    editorRowMoveGap(row, at);
+    editorRowGrowGap(row, 1);
+    // Fill the start of the gap with the character
+    row->chars[row->gap++] = c;
+    row->gaplen--;
     row->size++;
-    row->chars[at] = c;
+    if(c == '\t' && row->tabs >= 0)
+        row->tabs++;
+    rowTreeAdjust(row->leaf, 0, 1);
     // Update row so the new character renders
-    editorUpdateRow(row);
+    editorUpdateRowFrom(row, at, 1, NULL, 0);
+    editorInvalidateRow(row);
     E.dirty++;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    // Allocate memory for new string
-    row->chars = realloc(row->chars, row->size + len + 1);
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+    editorSaveTouch(row->leaf);
+    editorRowDetach(row);
+    // Make room for the new string at at
+    editorRowMoveGap(row, at);
+    editorRowGrowGap(row, len);
     // Copy new string
-    memcpy(&row->chars[row->size], s, len);
-    // Update row size + append null byte
+    memcpy(&row->chars[at], s, len);
+    for(size_t j = 0; j < len && row->tabs >= 0; j++) {
+        if(s[j] == '\t') row->tabs++;
+    }
+    // Update row size
+    row->gap += len;
+    row->gaplen -= len;
     row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    rowTreeAdjust(row->leaf, 0, len);
+    editorUpdateRowFrom(row, at, len, NULL, 0);
+    editorInvalidateRow(row);
     E.dirty++;
 }
 
-void editorRowDelChar(erow *row, int at) {
-    // check if cursor is past the start or end of the line
-    if(at < 0 || at >= row->size)
-        return;
-    // Overwrite deleted characters with those before it
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowInsertString(row, row->size, s, len);
 }
 
-int editorRowCxToRx(erow *row, int cx) {
-    // Translate tabs to spaces
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-        rx += (U.tabNo - 1) - (rx % U.tabNo);
-    rx++;
+void editorRowDelString(erow *row, int at, int len) {
+    // check the text is within the line
+    if(at < 0 || len <= 0 || at + len > row->size)
+        return;
+    editorSaveTouch(row->leaf);
+    editorRowDetach(row);
+    // Put the gap just after the text and widen it backwards over it
+    editorRowMoveGap(row, at + len);
+    for(int j = at; j < at + len && row->tabs >= 0; j++) {
+        if(row->chars[j] == '\t')
+            row->tabs--;
     }
-    return rx;
+    row->gap -= len;
+    row->gaplen += len;
+    row->size -= len;
+    rowTreeAdjust(row->leaf, 0, -len);
+    // The deleted text is still there at the start of the gap
+    editorUpdateRowFrom(row, at, 0, &row->chars[at], len);
+    editorInvalidateRow(row);
+    E.dirty++;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for(cx = 0; cx < row->size; cx++) {
-        // Translate tabs into spaces
-        if(row->chars[cx] == '\t')
-            cur_rx += (U.tabNo - 1) - (cur_rx % U.tabNo);
-        cur_rx++;
+void editorRowDelChar(erow *row, int at) {
+    // check if cursor is past the start or end of the line
+    if(at < 0 || at >= row->size)
+        return;
+    editorRowDelString(row, at, 1);
+}
 
-        // Once cur_rx hits the end of the rendered line, return the cx value
-        if(cur_rx > rx)
-            return cx;
-    }
-    return cx;
+void editorRowTruncate(erow *row, int at) {
+    // Cut the row short at chars index at
+    editorSaveTouch(row->leaf);
+    editorRowMoveGap(row, at);
+    // Widen the gap to the end.  A mapped row just gets shorter
+    if(!(row->flags & ROW_MAPPED))
+        row->gaplen += row->size - at;
+    rowTreeAdjust(row->leaf, 0, at - row->size);
+    row->size = at;
+    // Recount tabs when next needed
+    row->tabs = -1;
+    editorUpdateRowFrom(row, at, 0, NULL, 0);
+    editorInvalidateRow(row);
 }
 
 /* Editor operations */
 void editorInsertChar(int c) {
     // Check if cursor is on the tilde after the end of the file
     // Append new row before inserting a character
-    if(E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
+    int atEnd = (E.cy == editorNumRows());
+    if(atEnd) {
+        editorInsertRow(editorNumRows(), "", 0);
     }
 
     // Insert character and move cursor
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    erow *row = editorRowAt(E.cy);
+    editorRowInsertChar(row, E.cx, c);
     E.cx++;
 
     // Auto complete brackets and braces etc.
+    char typed[2] = {c, 0};
     switch(c) {
         case 123:
             // {            
         case 91:
             // [
             // Closing bracket is two away for { [
-            editorRowInsertChar(&E.row[E.cy], E.cx, c + 2);
+            typed[1] = c + 2;
             break;            
         case 40:
             // (
-            editorRowInsertChar(&E.row[E.cy], E.cx, c + 1);
+            typed[1] = c + 1;
             break;
         case 34:
             // "
         case 39:
             // '
-            editorRowInsertChar(&E.row[E.cy], E.cx, c);
+            typed[1] = c;
             break;
     }
+    if(typed[1])
+        editorRowInsertChar(row, E.cx, typed[1]);
+    editorUndoRecord(UNDO_INSERT, E.cy, E.cx - 1, typed, typed[1] ? 2 : 1, atEnd);
 }
 
 void editorInsertNewLine() {
+    editorUndoRecord(UNDO_INSERT, E.cy, E.cx, "\n", 1, 0);
     if(E.cx == 0) {
         // At beginning of line, insert empty row above
         editorInsertRow(E.cy, "", 0);
     } else {
         // Split row, insert row and put characters to the right of the cursor into the new row
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        // With the gap at the cursor, the text to its right is contiguous
+        erow *row = editorRowAt(E.cy);
+        editorRowMoveGap(row, E.cx);
+        editorInsertRow(E.cy + 1, &row->chars[E.cx + row->gaplen], row->size - E.cx);
+        editorRowTruncate(editorRowAt(E.cy), E.cx);
     }
     
     E.cy++;
     E.cx = 0;
 }
 
+void editorInsertText(const char *s, int len) {
+    // Insert a block of text at the cursor, for a paste or an undo.  Unlike typing there is no auto-pairing, and
+    // the rows are spliced in with highlighting, the match list and the dirty count brought up to date once at
+    // the end.  \n ends a line
+    int dirty = E.dirty;
+    if(E.cy == editorNumRows())
+        editorInsertRow(editorNumRows(), "", 0);
+    const char *end = s + len;
+    const char *eol = memchr(s, '\n', len);
+    erow *row = editorRowAt(E.cy);
+    if(eol == NULL) {
+        // One line: it goes straight into the current row
+        editorRowInsertString(row, E.cx, s, len);
+        E.cx += len;
+        E.dirty = dirty + 1;
+        return;
+    }
+
+    // The current row keeps the text before the cursor plus the first line, then come the middle lines,
+    // then the last line followed by the rest of the current row
+    editorRowMoveGap(row, E.cx);
+    int taillen = row->size - E.cx;
+    char *tail = malloc(taillen + 1);
+    memcpy(tail, &row->chars[E.cx + row->gaplen], taillen);
+    int at = E.cy;
+    int cut = E.cx;
+    int count = 0;
+    for(const char *p = eol; p; p = memchr(p + 1, '\n', end - p - 1)) {
+        count++;
+    }
+    // The new rows are built up here and go into the tree together
+    erow *rows = malloc(sizeof(erow) * count);
+    count = 0;
+    const char *line = eol;
+    while(line < end) {
+        // Step over the line ending to the next line
+        line++;
+        const char *next = memchr(line, '\n', end - line);
+        int last = (next == NULL);
+        if(last)
+            next = end;
+        int n = next - line;
+        char *chars = malloc(n + (last ? taillen : 0) + 1);
+        memcpy(chars, line, n);
+        if(last) {
+            memcpy(&chars[n], tail, taillen);
+            E.cx = n;
+            n += taillen;
+        }
+        editorRowInit(&rows[count++], chars, n, 0);
+        line = next;
+    }
+    free(tail);
+    rowTreeInsertRows(at + 1, rows, count);
+    free(rows);
+
+    // Cut the current row at the cursor and add the first line
+    row = editorRowAt(at);
+    editorRowTruncate(row, cut);
+    editorRowInsertString(row, cut, s, eol - s);
+
+    // The row after the paste follows a different row now
+    erow *next = editorRowAt(at + count + 1);
+    if(next)
+        editorMarkStale(next);
+    editorMatchRowsInserted(at + 1, count);
+    editorChunkRowsInserted(at + 1, count);
+    E.cy = at + count;
+    E.dirty = dirty + 1;
+}
+
+void editorDeleteText(int at, int col, const char *s, int len) {
+    // Remove the len bytes of text s that start at column col of line at, the other way round from
+    // editorInsertText: the rows it covers come out of the tree together, and highlighting, the match list and
+    // the dirty count are brought up to date once.  Text ending in \n that runs to the end of the file takes
+    // whole rows with it
+    int dirty = E.dirty;
+    int lines = editorCountByte(s, len, '\n');
+    if(lines == 0) {
+        editorRowDelString(editorRowAt(at), col, len);
+        E.dirty = dirty + 1;
+        return;
+    }
+    if(at + lines >= editorNumRows()) {
+        editorDeleteRows(at, editorNumRows() - at);
+        E.dirty = dirty + 1;
+        return;
+    }
+    // The first row keeps its text before col, followed by the last row's text after the deleted part
+    const char *lastnl = memrchr(s, '\n', len);
+    int from = len - (lastnl - s + 1);
+    erow *last = editorRowAt(at + lines);
+    int taillen = last->size - from;
+    char *tail = malloc(taillen + 1);
+    memcpy(tail, &editorRowText(last)[from], taillen);
+    erow *row = editorRowAt(at);
+    editorRowTruncate(row, col);
+    editorRowInsertString(row, col, tail, taillen);
+    free(tail);
+    editorDeleteRows(at + 1, lines);
+    E.dirty = dirty + 1;
+}
+
+void editorPaste(const char *text, int len) {
+    // Insert pasted text at the cursor as one change
+    if(len == 0)
+        return;
+    editorUndoRecord(UNDO_INSERT, E.cy, E.cx, text, len, E.cy == editorNumRows());
+    editorInsertText(text, len);
+}
+
 void editorDelChar() {
     // Check if cursor is past end of the file
-    if(E.cy == E.numrows)
+    if(E.cy == editorNumRows())
         return;
     // Check if cursor is at the start of the first row
     if(E.cx == 0 && E.cy == 0)
         return;
 
     // Get row and delete character to the left of the cursor
-    erow *row = &E.row[E.cy];
+    erow *row = editorRowAt(E.cy);
     if(E.cx > 0) {
+        // Read the byte through the gap rather than closing it to get at the text
+        char c = ROW_CHAR(row, E.cx - 1);
+        editorUndoRecord(UNDO_DELETE, E.cy, E.cx - 1, &c, 1, 0);
         editorRowDelChar(row, E.cx -1);
         E.cx--;
     } else {
         // Append the contents of the current row to the previous row, then delete current row
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+        erow *prev = editorRowAt(E.cy - 1);
+        editorUndoRecord(UNDO_DELETE, E.cy - 1, prev->size, "\n", 1, 0);
+        E.cx = prev->size;
+        editorRowAppendString(prev, editorRowText(row), row->size);
         editorDelRow(E.cy);
         E.cy--;
     }
 }
 
 
-/* File I/O */
-char *editorRowsToString(int *buflen) {
-    // Get length of all lines in file (plus newlines at the end of every line)
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++) {
-        totlen += E.row[j].size + 1;
-    }
-    *buflen = totlen;
+/* Undo */
+// Every edit is logged as text inserted or deleted at a line and column, taking the file as its rows each
+// followed by \n.  Operations are laid end to end in one arena, and typing or deleting next to the last change
+// in a row adds to it rather than starting a new one, so the log grows with the text edited and never holds
+// copies of rows.  Undo applies the inverse of the newest operation and steps back; redo steps forward again
+// until a new edit drops whatever was undone
+// A run of backspaces: each one deletes the byte before the last, so the text is kept back to front
+#define UNDO_REVERSED 1
 
-    // Allocate memory for buffer and copy all text into it
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j< E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
-    }
+struct undoOp {
+    int type;
+    int flags;
+    int row;
+    int col;
+    int len;
+    // Offset of the operation before this one, -1 for the first.  len bytes of text follow
+    int prev;
+};
 
-    return buf;
+struct undoLog {
+    char *arena;
+    int used;
+    int cap;
+    // Offset of the newest operation still applied, -1 if there is none
+    int last;
+    // Whether the next edit may be added to the newest operation
+    int open;
+};
+
+struct undoLog undo = {NULL, 0, 0, -1, 0};
+
+// Bytes an operation takes up in the arena, keeping the next one aligned
+#define UNDO_SIZE(len) ((int)((sizeof(struct undoOp) + (len) + 7) & ~7))
+
+struct undoOp *editorUndoOp(int off) {
+    return (struct undoOp *)&undo.arena[off];
 }
 
-void editorOpen(char *filename) {
-    // Set filename
-    free(E.filename);
-    E.filename = strdup(filename);
+char *editorUndoText(struct undoOp *op) {
+    return (char *)(op + 1);
+}
 
-    editorSelectSyntaxHighlight();
+int editorUndoEnd(int off) {
+    // Offset just past an operation, which is where the one after it starts
+    return (off < 0) ? 0 : off + UNDO_SIZE(editorUndoOp(off)->len);
+}
 
-    // Open file
-    FILE *fp = fopen(filename, "r");
-    if(!fp) {
-        die("fopen");
+int editorUndoLines(struct undoOp *op) {
+    // Newlines in op's text: the rows it adds or removes
+    int lines = 0;
+    char *text = editorUndoText(op);
+    for(int j = 0; j < op->len; j++) {
+        lines += (text[j] == '\n');
     }
+    return lines;
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    // Read lines until getlines() return -1 (End of file)
-    while((linelen = getline(&line, &linecap, fp)) != -1) {
-        // Strip newline/carriage returns
-        while(linelen > 0 && (line[linelen -1] == '\n' || line[linelen -1] == '\r'))
-            linelen--;
-        editorInsertRow(E.numrows, line, linelen);
-    }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+void editorUndoReserve(int need) {
+    // Room for the arena to reach need bytes.  It doubles, so appending a byte at a time is O(1) amortized
+    if(need <= undo.cap)
+        return;
+    undo.cap = (need > undo.cap * 2) ? need : undo.cap * 2;
+    undo.arena = realloc(undo.arena, undo.cap);
 }
 
-void editorSave() {
-    // Prompt user to provide filename if there is not one already
-    if(E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s", NULL);
-        if(E.filename == NULL) {
-            editorSetStatusMessage("Save aborted.");
-            return;
-        }
-        editorSelectSyntaxHighlight();
+void editorUndoRecord(int type, int row, int col, const char *s, int len, int newline) {
+    // Log an edit: len bytes of s inserted or deleted at row, col, then a \n if newline is set (for text that
+    // also added or removed the last row)
+    editorJournalAdd(type, row, col, s, len, newline);
+    int total = len + (newline ? 1 : 0);
+    // Whatever was undone can't be redone after a new edit
+    int end = editorUndoEnd(undo.last);
+    if(undo.used != end) {
+        undo.used = end;
+        undo.open = 0;
     }
-    // Get text in editor into a buffer
-    int len;
-    char *buf = editorRowsToString(&len);
-    // Write to file (create file if it doesn't exist already with normal permissions)
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if(fd != -1) {
-        // Set file's size to the specified length
-        if(ftruncate(fd, len) != -1) {
-            // Write to file
-            if(write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
+
+    // A character typed or deleted next to the last one in the same row joins it
+    int single = (total == 1 && s[0] != '\n');
+    if(undo.open && single) {
+        struct undoOp *op = editorUndoOp(undo.last);
+        int append = 0;
+        if(op->type == type && op->row == row) {
+            if(type == UNDO_INSERT) {
+                append = !(op->flags & UNDO_REVERSED) && op->col + op->len == col;
+            } else if(op->col == col && !(op->flags & UNDO_REVERSED)) {
+                // Delete key: the text carries on to the right
+                append = 1;
+            } else if(op->col == col + 1 && ((op->flags & UNDO_REVERSED) || op->len == 1)) {
+                // Backspace: the text grows to the left
+                op->flags |= UNDO_REVERSED;
+                op->col = col;
+                append = 1;
             }
         }
-        close(fd);
+        if(append) {
+            editorUndoReserve(undo.last + UNDO_SIZE(op->len + 1));
+            op = editorUndoOp(undo.last);
+            editorUndoText(op)[op->len++] = s[0];
+            undo.used = editorUndoEnd(undo.last);
+            return;
+        }
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
-}
-
-void configOpen(char *filename) {
-    // Init temp user config
-    struct userConfig ucTemp;
-
-    // Open file
-    FILE *fp = fopen(filename, "r");
-    char *line = NULL;
-
-    if(fp) {
-        size_t linecap = 0;
-        ssize_t linelen;
-
-        // Read lines until getline returns -1 (EOF)
-        while((linelen = getline(&line, &linecap, fp)) != -1) {
-            // Strip newline/carriage returns
-            while(linelen > 0 && (line[linelen -1] == '\n' || line[linelen -1] == '\r'))
-                linelen--;
 
-            char setting[20];
-            char value[20];
+    int off = undo.used;
+    editorUndoReserve(off + UNDO_SIZE(total));
+    struct undoOp *op = editorUndoOp(off);
+    op->type = type;
+    op->flags = 0;
+    op->row = row;
+    op->col = col;
+    op->len = total;
+    op->prev = undo.last;
+    memcpy(editorUndoText(op), s, len);
+    if(newline)
+        editorUndoText(op)[len] = '\n';
+    undo.last = off;
+    undo.used = editorUndoEnd(off);
+    undo.open = single;
+}
 
-            // Handle each setting here, ignoring commented lines
-            if(line[0] == '#' || sscanf(line, "%s %s", setting, value) != 2) {
-                // Fail
-                continue;
-            } else {
-                if(strcmp(setting, "tabstop")) {
-                    // tabstop setting
-                    int stop = atoi(value);
-                    ucTemp.tabNo = stop;
-                } else if(strcmp(setting, "quittimes")) {
-                    // quittimes setting
-                    int times = atoi(value);
-                    ucTemp.quitTimes = times;
-                }
-            }
+void editorApplyEdit(int type, int row, int col, const char *text, int len) {
+    // Insert or delete text at row, col, leaving the cursor at the end of an insert or where a delete was
+    if(type == UNDO_INSERT) {
+        E.cy = row;
+        E.cx = col;
+        // Text inserted past the last row made a new row, and ends with that row's \n
+        if(row == editorNumRows()) {
+            editorInsertRow(row, "", 0);
+            len--;
         }
-        U = ucTemp;
+        editorInsertText(text, len);
     } else {
-        die("fopen");
+        editorDeleteText(row, col, text, len);
+        E.cy = row;
+        E.cx = col;
     }
-    free(line);
-    fclose(fp);
-    return;
 }
 
-/* Find */
-void editorFindCallback(char *query, int key) {
-    // -1 if no last match or row match was on
-    // Only set this to anything other than -1 when an arrow key is pressed
-    static int last_match = -1;
-
-    // 1: search forward, -1: search backward
-    static int direction = 1;
-
-    // Save highlight colour to return to once search is exited
-    // Line that needs to be restored
-    static int saved_hl_line;
-    // NULL when there's nothing to restore
-    static char *saved_hl = NULL;
+void editorUndoApply(struct undoOp *op, int type) {
+    // Make op's change, or undo it, with type saying which
+    char *text = editorUndoText(op);
+    char *copy = NULL;
+    if(op->flags & UNDO_REVERSED) {
+        copy = malloc(op->len);
+        for(int j = 0; j < op->len; j++) {
+            copy[j] = text[op->len - 1 - j];
+        }
+        text = copy;
+    }
+    editorJournalAdd(type, op->row, op->col, text, op->len, 0);
+    editorApplyEdit(type, op->row, op->col, text, op->len);
+    free(copy);
+}
 
-    if(saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+void editorUndo() {
+    if(undo.last < 0) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
     }
+    struct undoOp *op = editorUndoOp(undo.last);
+    editorUndoApply(op, (op->type == UNDO_INSERT) ? UNDO_DELETE : UNDO_INSERT);
+    undo.last = op->prev;
+    undo.open = 0;
+}
 
-    // Stop if user presses enter or escape
-    if(key == '\r' || key == '\x1b') {
-        // Leave search mode, reset values to initial
-        last_match = -1;
-        direction = 1;
+void editorRedo() {
+    int next = editorUndoEnd(undo.last);
+    if(next >= undo.used) {
+        editorSetStatusMessage("Nothing to redo");
         return;
-    } else if(key == ARROW_RIGHT || key == ARROW_DOWN) {
-        // Search forwards
-        direction = 1;
-    } else if(key == ARROW_LEFT || key == ARROW_UP) {
-        // Search backwards
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
     }
+    struct undoOp *op = editorUndoOp(next);
+    editorUndoApply(op, op->type);
+    undo.last = next;
+    undo.open = 0;
+}
 
-    // You can only search forward if there are no results
-    if(last_match == -1)
-        direction = 1;
-    
-    // Index of row we are searching
-    int current = last_match;
-    // Loop through lines and search for string in each line
-    int i;
-    for(i = 0; i < E.numrows; i++) {
-        // Move forward/back a line
-        current += direction;
-        // Allow wrap around to beginning of file from end or vice versa
-        if(current == -1) {
-            current = E.numrows - 1;
+/* File I/O */
+int editorWriteAll(int fd, struct iovec *iov, int n) {
+    // writev all n buffers, carrying on after partial writes.  Returns -1 on error
+    while(n > 0) {
+        ssize_t written = writev(fd, iov, n);
+        if(written == -1) {
+            if(errno == EINTR)
+                continue;
+            return -1;
         }
-        else if(current == E.numrows) {
-            current = 0;
+        // Skip the buffers written in full, and the written part of the next one
+        while(n > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            n--;
         }
-        
-        erow *row = &E.row[current];
-
-        char *match = strstr(row->render, query);
-        if(match) {
-            // Set up last match for the next time round
-            last_match = current;
-            E.cy = current;
-            // Move cursor to the start of the result
-            E.cx = editorRowRxToCx(row, match - row->render);
-            // Scroll result to the top next screen refresh
-            E.rowoff = E.numrows;
-
-            // Set colour
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
+        if(n > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
         }
     }
+    return 0;
+}
+
+int editorPreadAll(int fd, char *buf, long long len, long long off) {
+    // pread all len bytes, carrying on after short reads.  Returns -1 on error or end of file
+    while(len > 0) {
+        ssize_t got = pread(fd, buf, len, off);
+        if(got == -1 && errno == EINTR)
+            continue;
+        if(got <= 0)
+            return -1;
+        buf += got;
+        off += got;
+        len -= got;
+    }
+    return 0;
+}
+
+int editorWriteExtents(struct saveJob *job, int from, int to, char *buf, int cap) {
+    // Write extents from to to of a save, reading those in files through buf.  Returns errno of any failure
+    for(int i = from; i < to; i++) {
+        struct saveExtent *ext = &job->extents[i];
+        for(long long done = 0; done < ext->len; ) {
+            long long n = (ext->len - done < cap) ? ext->len - done : cap;
+            struct iovec iov = {buf, n};
+            if(ext->text) {
+                iov.iov_base = (char *)ext->text + done;
+            } else if(editorPreadAll(ext->fd, buf, n, ext->off + done) == -1) {
+                return errno ? errno : EIO;
+            }
+            if(editorWriteAll(job->fd, &iov, 1) == -1)
+                return errno;
+            done += n;
+            pthread_mutex_lock(&job->lock);
+            job->written += n;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    return 0;
+}
+
+void editorSyncDir(char *path) {
+    // fsync the directory holding path, so a rename into it survives a crash
+    char *dir = strdup(path);
+    char *slash = strrchr(dir, '/');
+    if(slash == NULL) {
+        strcpy(dir, ".");
+    } else {
+        slash[slash == dir] = '\0';
+    }
+    int fd = open(dir, O_RDONLY);
+    if(fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+int editorGatherRows(erow *rows, int count, struct iovec *iov, int n, char *buf, int *used) {
+    // Add count rows, each with its newline, to the n buffers in iov.  Mapped text is pointed at, and
+    // unedited rows that follow each other in the original file (newline included) run into one buffer.
+    // Edited text is copied into buf from *used on, where consecutive rows also run together.
+    // The text either side of a row's gap is read in place: the writer must not move it.  Returns the new n
+    for(int j = 0; j < count; j++) {
+        erow *row = &rows[j];
+        char *text;
+        int len;
+        if(row->flags & ROW_MAPPED) {
+            text = row->chars;
+            len = row->size;
+            if(text + len < E.map + E.maplen && text[len] == '\n') {
+                len++;
+            } else {
+                // No newline after it in the map, so copy it out with one
+                memcpy(&buf[*used], text, len);
+                text = &buf[*used];
+                text[len++] = '\n';
+                *used += len;
+            }
+        } else {
+            text = &buf[*used];
+            memcpy(text, row->chars, row->gap);
+            memcpy(&text[row->gap], &row->chars[row->gap + row->gaplen], row->size - row->gap);
+            len = row->size;
+            text[len++] = '\n';
+            *used += len;
+        }
+        if(n > 0 && (char *)iov[n - 1].iov_base + iov[n - 1].iov_len == text) {
+            iov[n - 1].iov_len += len;
+        } else {
+            iov[n].iov_base = text;
+            iov[n].iov_len = len;
+            n++;
+        }
+    }
+    return n;
+}
+
+void *editorSaveThread(void *arg) {
+    // Writer thread: stream the snapshot into the temporary file a batch of leaves at a time, then put it in place.
+    // Rows are only looked at with the lock held, and written out after it is dropped
+    struct saveJob *job = arg;
+    struct iovec iov[KILO_SAVE_IOV];
+    int cap = KILO_SAVE_CHUNK;
+    char *buf = malloc(cap);
+    int err = editorWriteExtents(job, 0, job->split, buf, cap);
+    int finished = 0;
+    while(!finished && !err) {
+        int n = 0;
+        int used = 0;
+        pthread_mutex_lock(&job->lock);
+        while(job->next < job->nleaves) {
+            struct saveLeaf *saved = job->saved[job->next];
+            erow *rows = saved ? saved->rows : job->leaves[job->next]->rows;
+            int count = saved ? saved->n : job->leaves[job->next]->n;
+            // Worst case room the leaf needs: every row copied, with its own buffer
+            int need = 0;
+            for(int j = 0; j < count; j++) {
+                need += rows[j].size + 1;
+            }
+            if(n + count > KILO_SAVE_IOV || used + need > cap) {
+                if(n > 0)
+                    break;
+                // One leaf bigger than the buffer, grow it while nothing points into it
+                cap = need;
+                buf = realloc(buf, cap);
+            }
+            n = editorGatherRows(rows, count, iov, n, buf, &used);
+            job->next++;
+        }
+        finished = (job->next == job->nleaves);
+        pthread_mutex_unlock(&job->lock);
+
+        long long bytes = 0;
+        for(int j = 0; j < n; j++) {
+            bytes += iov[j].iov_len;
+        }
+        if(editorWriteAll(job->fd, iov, n) == -1)
+            err = errno;
+        pthread_mutex_lock(&job->lock);
+        job->written += bytes;
+        pthread_mutex_unlock(&job->lock);
+    }
+    if(!err)
+        err = editorWriteExtents(job, job->split, job->nextents, buf, cap);
+    free(buf);
+
+    if(!err && ((U.saveSync && fsync(job->fd) == -1) || close(job->fd) == -1))
+        err = errno;
+    else if(err)
+        close(job->fd);
+    job->fd = -1;
+    if(!err && rename(job->tmp, job->path) == -1)
+        err = errno;
+    if(err) {
+        unlink(job->tmp);
+    } else if(U.saveSync) {
+        editorSyncDir(job->path);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->err = err;
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+void editorSaveTouch(struct rowNode *leaf) {
+    // Called before the rows of leaf change.  If the running save hasn't written the leaf yet, keep a copy of it
+    // as it was for the writer.  Either way the save has no more claim on the leaf
+    struct saveJob *job = E.save;
+    if(job == NULL || leaf->save_idx < 0)
+        return;
+    int i = leaf->save_idx;
+    leaf->save_idx = -1;
+    if(i < job->next)
+        return;
+    struct saveLeaf *saved = malloc(sizeof(struct saveLeaf));
+    saved->n = leaf->n;
+    saved->rows = malloc(sizeof(erow) * leaf->n);
+    memcpy(saved->rows, leaf->rows, sizeof(erow) * leaf->n);
+    for(int j = 0; j < saved->n; j++) {
+        erow *row = &saved->rows[j];
+        if(row->flags & ROW_MAPPED)
+            continue;
+        // Edited text gets copied, closing the gap on the way
+        char *chars = malloc(row->size + 1);
+        memcpy(chars, row->chars, row->gap);
+        memcpy(&chars[row->gap], &row->chars[row->gap + row->gaplen], row->size - row->gap);
+        row->chars = chars;
+        row->gap = row->size;
+        row->gaplen = 0;
+    }
+    job->saved[i] = saved;
+}
+
+void editorSaveFinish() {
+    // Tidy up after the writer thread has finished, and report how it went.  Only changes made since the
+    // snapshot are left counting as unsaved
+    struct saveJob *job = E.save;
+    pthread_mutex_unlock(&job->lock);
+    pthread_join(job->thread, NULL);
+    pthread_mutex_destroy(&job->lock);
+    E.save = NULL;
+    editorChunkSaved();
+
+    if(job->err == 0) {
+        E.dirty -= job->dirty;
+        if(E.dirty < 0)
+            E.dirty = 0;
+        editorSetStatusMessage("%lld bytes written to disk", job->total);
+        editorJournalSaved(job->path, job->journal);
+    } else {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+    }
+
+    for(int i = 0; i < job->nleaves; i++) {
+        struct saveLeaf *saved = job->saved[i];
+        if(saved == NULL)
+            continue;
+        for(int j = 0; j < saved->n; j++) {
+            if(!(saved->rows[j].flags & ROW_MAPPED))
+                free(saved->rows[j].chars);
+        }
+        free(saved->rows);
+        free(saved);
+    }
+    free(job->leaves);
+    free(job->saved);
+    free(job->extents);
+    free(job->tmp);
+    free(job->path);
+    free(job);
+
+    // Ctrl-S pressed while this save ran
+    if(E.save_pending) {
+        E.save_pending = 0;
+        editorSave();
+    }
+}
+
+int editorSavePoll() {
+    // Check on a background save from the main loop: finish it off if it is done, otherwise show progress.
+    // Returns 1 if the status message changed
+    static int shown = -1;
+    struct saveJob *job = E.save;
+    if(job == NULL)
+        return 0;
+    if(job->done) {
+        editorSaveFinish();
+        shown = -1;
+        return 1;
+    }
+    int percent = job->total ? (int)(job->written * 100 / job->total) : 0;
+    if(percent == shown)
+        return 0;
+    shown = percent;
+    editorSetStatusMessage("Saving... %d%%", percent);
+    return 1;
+}
+
+void editorSaveWait() {
+    // Block until a background save is finished, and any save asked for while it ran, for when the editor is
+    // about to exit.  editorSaveFinish lets go of the lock and waits for the writer
+    while(E.save)
+        editorSaveFinish();
+}
+
+void editorOpen(char *filename) {
+    // Set filename
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    // Open file
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1) {
+        die("open");
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1) {
+        die("fstat");
+    }
+
+    // Map the whole file instead of reading it.  Pages are only faulted in when a row is looked at,
+    // and the mapping stays valid after the descriptor is closed
+    E.map = NULL;
+    E.maplen = st.st_size;
+    if(E.maplen > 0) {
+        E.map = mmap(NULL, E.maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(E.map == MAP_FAILED) {
+            die("mmap");
+        }
+    }
+    close(fd);
+
+    // Split into rows that point into the mapping
+    char *p = E.map;
+    char *end = E.map + E.maplen;
+    while(p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        char *next = nl ? nl + 1 : end;
+        size_t linelen = (nl ? nl : end) - p;
+        // Strip carriage returns
+        while(linelen > 0 && p[linelen - 1] == '\r')
+            linelen--;
+        editorInsertMappedRow(editorNumRows(), p, linelen);
+        p = next;
+    }
+    E.dirty = 0;
+}
+
+void editorClose() {
+    // Drop the open file and everything that refers to its rows, leaving an empty buffer with no name
+    editorSaveWait();
+    editorMatchClear();
+    editorFindReset();
+    if(editorNumRows() > 0)
+        editorDeleteRows(0, editorNumRows());
+    if(E.map)
+        munmap(E.map, E.maplen);
+    E.map = NULL;
+    E.maplen = 0;
+    E.cx = E.cy = E.rx = 0;
+    E.rowoff = E.coloff = 0;
+    E.dirty = 0;
+    E.hl_stale_from = 0;
+    E.hl_pending = 0;
+    undo.used = 0;
+    undo.last = -1;
+    undo.open = 0;
+    free(E.filename);
+    E.filename = NULL;
+    E.syntax = NULL;
+}
+
+void editorSave() {
+    // Prompt user to provide filename if there is not one already
+    if(E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s", NULL);
+        if(E.filename == NULL) {
+            editorSetStatusMessage("Save aborted.");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+    if(E.save) {
+        // The running save has a snapshot from before the latest edits: save again as soon as it's done
+        E.save_pending = 1;
+        editorSetStatusMessage("Saving again when this save is done");
+        return;
+    }
+    // Write to a temporary file next to the real one (following symlinks), then rename it over the top.
+    // The original is never half written, and the old file stays alive for the rows still mapped from it
+    char *path = realpath(E.filename, NULL);
+    if(path == NULL)
+        path = strdup(E.filename);
+    char *tmp = malloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if(fd == -1) {
+        free(tmp);
+        free(path);
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+        return;
+    }
+    // Keep the original's permissions, or the usual ones for a new file (mkstemp uses 0600)
+    struct stat st;
+    mode_t mode;
+    if(stat(path, &st) == 0) {
+        mode = st.st_mode & 07777;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0644 & ~mask;
+    }
+    fchmod(fd, mode);
+
+    // Snapshot the rows: just the list of leaves, each tagged with its place in it.  A leaf is only copied
+    // if it is changed before the writer gets to it
+    struct saveJob *job = malloc(sizeof(struct saveJob));
+    int nleaves = 0;
+    int cap = 64;
+    job->leaves = malloc(sizeof(struct rowNode *) * cap);
+    erow *row = editorRowAt(0);
+    while(row) {
+        struct rowNode *leaf = row->leaf;
+        if(nleaves == cap) {
+            cap *= 2;
+            job->leaves = realloc(job->leaves, sizeof(struct rowNode *) * cap);
+        }
+        leaf->save_idx = nleaves;
+        job->leaves[nleaves++] = leaf;
+        row = editorRowNext(&leaf->rows[leaf->n - 1]);
+    }
+    job->nleaves = nleaves;
+    job->saved = calloc(nleaves ? nleaves : 1, sizeof(struct saveLeaf *));
+    job->next = 0;
+    job->fd = fd;
+    job->tmp = tmp;
+    job->path = path;
+    job->total = E.rows->numbytes;
+    job->written = 0;
+    job->extents = NULL;
+    job->nextents = 0;
+    job->split = 0;
+    editorChunkExtents(job);
+    job->dirty = E.dirty;
+    job->journal = editorJournalMark(path);
+    job->done = 0;
+    job->err = 0;
+
+    // The main thread holds the lock from here on, letting go of it only while waiting for keys
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_mutex_lock(&job->lock);
+    E.save = job;
+    int err = pthread_create(&job->thread, NULL, editorSaveThread, job);
+    if(err) {
+        // Nothing to wait for, so just throw the job away
+        close(fd);
+        unlink(tmp);
+        job->done = 1;
+        job->err = err;
+        pthread_mutex_unlock(&job->lock);
+        pthread_mutex_destroy(&job->lock);
+        E.save = NULL;
+        free(job->leaves);
+        free(job->saved);
+        free(job->extents);
+        free(tmp);
+        free(path);
+        free(job);
+        editorSetStatusMessage("Can't save! %s", strerror(err));
+        return;
+    }
+    editorSetStatusMessage("Saving...");
+}
+
+void configDefaults(struct userConfig *uc) {
+    // Settings used for anything the config file doesn't set
+    uc->tabNo = KILO_TAB_STOP;
+    uc->quitTimes = KILO_QUIT_TIMES;
+    uc->saveSync = 0;
+    uc->journalSync = 0;
+    uc->findThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    uc->latencyLog = NULL;
+    uc->allocLog = NULL;
+    uc->chunkMemory = KILO_CHUNK_MEMORY;
+}
+
+void configOpen(char *filename) {
+    // Init temp user config, with defaults for anything the file doesn't set
+    struct userConfig ucTemp;
+    configDefaults(&ucTemp);
+
+    // Open file
+    FILE *fp = fopen(filename, "r");
+    char *line = NULL;
+
+    if(fp) {
+        size_t linecap = 0;
+        ssize_t linelen;
+
+        // Read lines until getline returns -1 (EOF)
+        while((linelen = getline(&line, &linecap, fp)) != -1) {
+            // Strip newline/carriage returns
+            while(linelen > 0 && (line[linelen -1] == '\n' || line[linelen -1] == '\r'))
+                linelen--;
+
+            char setting[20];
+            char value[256];
+
+            // Handle each setting here, ignoring commented lines
+            if(line[0] == '#' || sscanf(line, "%19s %255s", setting, value) != 2) {
+                // Fail
+                continue;
+            } else {
+                if(!strcmp(setting, "tabstop")) {
+                    // tabstop setting
+                    int stop = atoi(value);
+                    ucTemp.tabNo = stop;
+                } else if(!strcmp(setting, "quittimes")) {
+                    // quittimes setting
+                    int times = atoi(value);
+                    ucTemp.quitTimes = times;
+                } else if(!strcmp(setting, "fsync")) {
+                    // fsync setting, 1 to flush saves to disk
+                    ucTemp.saveSync = atoi(value);
+                } else if(!strcmp(setting, "journalsync")) {
+                    // journalsync setting, milliseconds between fsyncs of the journal
+                    ucTemp.journalSync = atoi(value);
+                } else if(!strcmp(setting, "searchthreads")) {
+                    // searchthreads setting, 1 to search on the main thread only
+                    ucTemp.findThreads = atoi(value);
+                } else if(!strcmp(setting, "latencylog")) {
+                    // latencylog setting, file to append latency histograms to at exit
+                    free(ucTemp.latencyLog);
+                    ucTemp.latencyLog = strdup(value);
+                } else if(!strcmp(setting, "alloclog")) {
+                    // alloclog setting, file for the allocation profile of a make alloc build
+                    free(ucTemp.allocLog);
+                    ucTemp.allocLog = strdup(value);
+                } else if(!strcmp(setting, "chunkmemory")) {
+                    // chunkmemory setting, megabytes of changed chunks to keep before spilling them to disk
+                    ucTemp.chunkMemory = atoi(value);
+                }
+            }
+        }
+        if(ucTemp.findThreads < 1)
+            ucTemp.findThreads = 1;
+        U = ucTemp;
+    } else {
+        die("fopen");
+    }
+    free(line);
+    fclose(fp);
+    return;
+}
+
+/* Journal */
+// Unsaved edits are also appended to a swap file next to the file being edited, .name.kswp, so they survive
+// the editor or its terminal going away.  The journal starts with the identity of the file on disk that the
+// edits apply to, followed by the edits themselves as they go through the undo log.  Entries are collected in
+// memory and written out together a moment later, and fsynced every so often if the config asks for it.
+// Opening a file with a journal left behind by a crash replays it; quitting or saving starts it afresh
+struct journalHeader {
+    char magic[8];
+    // Size, inode and modification time of the file the entries apply to
+    long long size;
+    long long ino;
+    long long mtime;
+    long long mtime_ns;
+    // Editor writing to it
+    int pid;
+    int unused;
+};
+
+struct journalEntry {
+    int type;
+    int row;
+    int col;
+    // Length of the text that follows
+    int len;
+};
+
+struct journal {
+    char *path;
+    // Created by the first edit, -1 until then
+    int fd;
+    // Set once writing failed, or another editor has the file open
+    int off;
+    // The identity in head is known.  A new file gets one when it is first saved
+    int valid;
+    struct journalHeader head;
+    // Entries not written out yet
+    char *buf;
+    int used;
+    int cap;
+    // Bytes of entries in the file, not counting the header
+    long long written;
+    // When buf is due to be written, and when the file was last fsynced
+    long long due;
+    long long synced;
+    int unsynced;
+    // Edits being replayed from the journal aren't added to it again
+    int replaying;
+};
+
+struct journal journal = {NULL, -1, 0, 0, {{0}, 0, 0, 0, 0, 0, 0}, NULL, 0, 0, 0, 0, 0, 0, 0};
+
+char *editorJournalPath(const char *filename) {
+    // .name.kswp in the same directory as name
+    const char *base = strrchr(filename, '/');
+    int dirlen = base ? base - filename + 1 : 0;
+    base = base ? base + 1 : filename;
+    char *path = malloc(strlen(filename) + 7);
+    sprintf(path, "%.*s.%s.kswp", dirlen, filename, base);
+    return path;
+}
+
+int editorJournalIdentify(const char *filename, struct journalHeader *head) {
+    struct stat st;
+    if(stat(filename, &st) == -1)
+        return -1;
+    memset(head, 0, sizeof(*head));
+    memcpy(head->magic, "KILOJNL1", 8);
+    head->size = st.st_size;
+    head->ino = st.st_ino;
+    head->mtime = st.st_mtim.tv_sec;
+    head->mtime_ns = st.st_mtim.tv_nsec;
+    head->pid = getpid();
+    return 0;
+}
+
+void editorJournalFail(const char *what) {
+    // Give up on the journal for the rest of the session, leaving what was written of it
+    editorSetStatusMessage("Journal %s failed, edits not journalled: %s", what, strerror(errno));
+    if(journal.fd != -1)
+        close(journal.fd);
+    journal.fd = -1;
+    journal.off = 1;
+    journal.used = 0;
+}
+
+void editorJournalFlush() {
+    // Write the buffered entries to the end of the journal, creating it for the first ones
+    if(journal.off || !journal.valid || journal.used == 0)
+        return;
+    if(journal.fd == -1) {
+        journal.fd = open(journal.path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+        if(journal.fd == -1) {
+            editorJournalFail("open");
+            return;
+        }
+        struct iovec iov = {&journal.head, sizeof(journal.head)};
+        if(editorWriteAll(journal.fd, &iov, 1) == -1) {
+            editorJournalFail("write");
+            return;
+        }
+        journal.written = 0;
+        journal.synced = editorNowMs();
+    }
+    struct iovec iov = {journal.buf, journal.used};
+    if(editorWriteAll(journal.fd, &iov, 1) == -1) {
+        editorJournalFail("write");
+        return;
+    }
+    journal.written += journal.used;
+    journal.used = 0;
+    journal.unsynced = 1;
+}
+
+void editorJournalAdd(int type, int row, int col, const char *s, int len, int newline) {
+    // Queue an edit, in the same terms as editorUndoRecord
+    if(journal.off || journal.replaying || journal.path == NULL)
+        return;
+    struct journalEntry entry = {type, row, col, len + (newline ? 1 : 0)};
+    int need = journal.used + sizeof(entry) + entry.len;
+    if(need > journal.cap) {
+        journal.cap = (need > journal.cap * 2) ? need : journal.cap * 2;
+        journal.buf = realloc(journal.buf, journal.cap);
+    }
+    if(journal.used == 0)
+        journal.due = editorNowMs() + KILO_JOURNAL_MS;
+    memcpy(&journal.buf[journal.used], &entry, sizeof(entry));
+    memcpy(&journal.buf[journal.used + sizeof(entry)], s, len);
+    if(newline)
+        journal.buf[journal.used + sizeof(entry) + len] = '\n';
+    journal.used = need;
+    // Big edits don't wait
+    if(journal.used >= KILO_JOURNAL_BATCH)
+        editorJournalFlush();
+}
+
+int editorJournalWait() {
+    // Milliseconds until the journal needs writing or fsyncing, -1 if it doesn't
+    long long now = editorNowMs();
+    long long at = -1;
+    if(journal.used > 0 && journal.valid)
+        at = journal.due;
+    if(journal.unsynced && U.journalSync > 0 && (at < 0 || journal.synced + U.journalSync < at))
+        at = journal.synced + U.journalSync;
+    if(at < 0)
+        return -1;
+    return (at > now) ? at - now : 0;
+}
+
+void editorJournalTick() {
+    // Called from the main loop: write out entries that have waited long enough, and fsync on the timer
+    long long now = editorNowMs();
+    if(journal.used > 0 && now >= journal.due)
+        editorJournalFlush();
+    if(journal.unsynced && U.journalSync > 0 && now >= journal.synced + U.journalSync) {
+        if(journal.fd != -1)
+            fdatasync(journal.fd);
+        journal.synced = now;
+        journal.unsynced = 0;
+    }
+}
+
+long long editorJournalMark(const char *filename) {
+    // Position in the stream of entries, taken when a save snapshots the rows.  A new file starts collecting
+    // entries from here, to be written once the save gives it an identity
+    if(journal.path == NULL)
+        journal.path = editorJournalPath(filename);
+    return journal.written + journal.used;
+}
+
+void editorJournalSaved(const char *filename, long long mark) {
+    // A save has put the snapshot taken at mark on disk.  Only entries after mark still count, and they now
+    // apply to the new file: write them to a new journal and put it in place of the old one
+    if(journal.off)
+        return;
+    if(journal.path == NULL)
+        journal.path = editorJournalPath(filename);
+    if(editorJournalIdentify(filename, &journal.head) == -1) {
+        editorJournalFail("stat");
+        return;
+    }
+    journal.valid = 1;
+
+    // Entries after mark: the end of the file, then the buffer
+    long long from = (mark < journal.written) ? mark : journal.written;
+    long long tail = journal.written - from;
+    int skip = (mark > journal.written) ? mark - journal.written : 0;
+    if(journal.fd == -1)
+        tail = 0;
+    if(tail == 0 && journal.used == skip) {
+        // Nothing left unsaved, so no journal until the next edit
+        if(journal.fd != -1) {
+            close(journal.fd);
+            unlink(journal.path);
+        }
+        journal.fd = -1;
+        journal.written = 0;
+        journal.used = 0;
+        journal.unsynced = 0;
+        return;
+    }
+    char *tmp = malloc(strlen(journal.path) + 8);
+    sprintf(tmp, "%s.XXXXXX", journal.path);
+    int fd = mkstemp(tmp);
+    int err = (fd == -1);
+    struct iovec head = {&journal.head, sizeof(journal.head)};
+    if(!err && editorWriteAll(fd, &head, 1) == -1)
+        err = 1;
+    // The old file's entries a chunk at a time, as there may be more of them than fit in memory
+    char *old = malloc(KILO_SAVE_CHUNK);
+    for(long long done = 0; !err && done < tail;) {
+        long long n = (tail - done < KILO_SAVE_CHUNK) ? tail - done : KILO_SAVE_CHUNK;
+        struct iovec chunk = {old, n};
+        if(editorPreadAll(journal.fd, old, n, sizeof(journal.head) + from + done) == -1 ||
+            editorWriteAll(fd, &chunk, 1) == -1)
+            err = 1;
+        done += n;
+    }
+    free(old);
+    struct iovec rest = {&journal.buf[skip], journal.used - skip};
+    if(!err && (editorWriteAll(fd, &rest, 1) == -1 || rename(tmp, journal.path) == -1))
+        err = 1;
+    if(err) {
+        if(fd != -1) {
+            close(fd);
+            unlink(tmp);
+        }
+        free(tmp);
+        editorJournalFail("rewrite");
+        return;
+    }
+    free(tmp);
+    if(journal.fd != -1)
+        close(journal.fd);
+    fcntl(fd, F_SETFL, O_APPEND);
+    journal.fd = fd;
+    journal.written = tail + journal.used - skip;
+    journal.used = 0;
+    journal.unsynced = 1;
+}
+
+int editorTextMatches(int at, int col, const char *s, int len) {
+    // Whether text s is in the rows starting at line at, column col, taking each row to end with \n
+    erow *row = editorRowAt(at);
+    while(len > 0) {
+        if(row == NULL)
+            return 0;
+        const char *nl = memchr(s, '\n', len);
+        int n = nl ? nl - s : len;
+        if(col + n > row->size || memcmp(&editorRowText(row)[col], s, n))
+            return 0;
+        if(nl == NULL)
+            return 1;
+        if(col + n != row->size)
+            return 0;
+        s += n + 1;
+        len -= n + 1;
+        col = 0;
+        row = editorRowNext(row);
+    }
+    return 1;
+}
+
+int editorJournalReplay(const char *data, long long len, long long *good) {
+    // Apply the entries in data, stopping at one that was cut short or doesn't fit the text.  Each goes into
+    // the undo log too.  Returns the number applied, with *good set to the bytes they take up
+    int count = 0;
+    long long pos = 0;
+    journal.replaying = 1;
+    while(len - pos >= (long long)sizeof(struct journalEntry)) {
+        struct journalEntry entry;
+        memcpy(&entry, &data[pos], sizeof(entry));
+        const char *text = &data[pos + sizeof(entry)];
+        int rows = editorNumRows();
+        if(entry.len <= 0 || entry.len > len - pos - (long long)sizeof(entry) || entry.row < 0 || entry.row > rows
+            || entry.col < 0)
+            break;
+        if(entry.type == UNDO_INSERT) {
+            if(entry.col > ((entry.row < rows) ? editorRowAt(entry.row)->size : 0))
+                break;
+        } else if(entry.type != UNDO_DELETE || !editorTextMatches(entry.row, entry.col, text, entry.len)) {
+            break;
+        }
+        editorUndoRecord(entry.type, entry.row, entry.col, text, entry.len, 0);
+        editorApplyEdit(entry.type, entry.row, entry.col, text, entry.len);
+        pos += sizeof(entry) + entry.len;
+        count++;
+    }
+    journal.replaying = 0;
+    *good = pos;
+    return count;
+}
+
+void editorJournalOpen() {
+    // Start journalling edits to the file just opened, first replaying a journal a crash left behind for it.
+    // It goes next to the file itself, as a save does
+    char *path = realpath(E.filename, NULL);
+    journal.path = editorJournalPath(path ? path : E.filename);
+    free(path);
+    if(editorJournalIdentify(E.filename, &journal.head) == -1)
+        return;
+    journal.valid = 1;
+    int fd = open(journal.path, O_RDWR);
+    if(fd == -1)
+        return;
+    struct stat st;
+    struct journalHeader head;
+    if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(head) || read(fd, &head, sizeof(head)) != sizeof(head)
+        || memcmp(head.magic, journal.head.magic, 8)) {
+        // Not a journal we can read.  It gets replaced by the first edit
+        close(fd);
+        return;
+    }
+    if(head.pid != journal.head.pid && (kill(head.pid, 0) == 0 || errno == EPERM)) {
+        close(fd);
+        journal.off = 1;
+        editorSetStatusMessage("%s is in use by process %d, edits not journalled", journal.path, head.pid);
+        return;
+    }
+    if(head.size != journal.head.size || head.ino != journal.head.ino || head.mtime != journal.head.mtime
+        || head.mtime_ns != journal.head.mtime_ns) {
+        close(fd);
+        editorSetStatusMessage("%s is for a different version of the file, ignored", journal.path);
+        return;
+    }
+
+    long long len = st.st_size - sizeof(head);
+    char *data = malloc(len + 1);
+    if(pread(fd, data, len, sizeof(head)) != len) {
+        free(data);
+        close(fd);
+        return;
+    }
+    long long good;
+    int count = editorJournalReplay(data, len, &good);
+    free(data);
+    // Drop anything after the last good entry and take the journal over, appending from here on
+    if(ftruncate(fd, sizeof(head) + good) == -1 || pwrite(fd, &journal.head, sizeof(head), 0) != sizeof(head)) {
+        close(fd);
+        editorJournalFail("recovery");
+        return;
+    }
+    fcntl(fd, F_SETFL, O_APPEND);
+    journal.fd = fd;
+    journal.written = good;
+    journal.synced = editorNowMs();
+    if(good == 0) {
+        close(fd);
+        unlink(journal.path);
+        journal.fd = -1;
+        return;
+    }
+    editorSetStatusMessage("Recovered %d unsaved edit%s from %s", count, (count == 1) ? "" : "s", journal.path);
+}
+
+void editorJournalClose() {
+    // The editor is quitting on purpose: whatever wasn't saved was meant to be thrown away
+    if(journal.fd == -1)
+        return;
+    close(journal.fd);
+    unlink(journal.path);
+    journal.fd = -1;
+}
+
+/* Viewer */
+// With --view the file is only looked at, never changed, so it doesn't need to fit in memory.  The row tree holds
+// a window of at most KILO_VIEW_ROWS lines, mapped from the file a span at a time, and the window is moved along
+// as the screen nears either end of it.  Meanwhile a thread counts the lines of the whole file, keeping where every
+// KILO_VIEW_STRIDE'th line starts, so a line number is found by reading at most a stride of lines.  The window's
+// line numbers come from the same count, and aren't known after jumping to the end until the count gets there
+struct viewer {
+    int on;
+    int fd;
+    long long size;
+    // File offsets of the window's first row and of the end of its last row, and the line number of its
+    // first row, -1 if not known yet
+    long long start;
+    long long end;
+    long long line;
+    // Mapping the window's rows point into, and where in the file it starts
+    char *map;
+    size_t maplen;
+    long long mapoff;
+    // Index, filled in by the thread and read under lock.  offsets[k] is where line k * KILO_VIEW_STRIDE starts
+    pthread_t thread;
+    pthread_mutex_t lock;
+    long long *offsets;
+    int noffsets;
+    int capoffsets;
+    // Lines and bytes counted so far, and whether the whole file has been
+    long long lines;
+    long long scanned;
+    int done;
+    // What the main thread last saw of the count, for the status bar
+    long long total;
+    int percent;
+    int indexed;
+};
+
+struct viewer view = {0, -1, 0, 0, 0, 0, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, 0, 0, 0, 0};
+
+void *editorViewThread(void *unused) {
+    // Count the lines of the file, noting where every KILO_VIEW_STRIDE'th one starts
+    (void)unused;
+    char *buf = malloc(KILO_VIEW_READ);
+    long long off = 0;
+    long long lines = 0;
+    while(off < view.size) {
+        ssize_t n = pread(view.fd, buf, KILO_VIEW_READ, off);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        // Most chunks don't reach the next stride, so only count their newlines
+        int count = editorCountByte(buf, n, '\n');
+        if((lines + count) / KILO_VIEW_STRIDE == lines / KILO_VIEW_STRIDE) {
+            lines += count;
+        } else {
+            char *p = buf;
+            char *end = buf + n;
+            while((p = memchr(p, '\n', end - p)) != NULL) {
+                p++;
+                lines++;
+                long long at = off + (p - buf);
+                if(lines % KILO_VIEW_STRIDE == 0 && at < view.size) {
+                    pthread_mutex_lock(&view.lock);
+                    if(view.noffsets == view.capoffsets) {
+                        view.capoffsets *= 2;
+                        view.offsets = realloc(view.offsets, view.capoffsets * sizeof(long long));
+                    }
+                    view.offsets[view.noffsets++] = at;
+                    pthread_mutex_unlock(&view.lock);
+                }
+            }
+        }
+        off += n;
+        pthread_mutex_lock(&view.lock);
+        view.lines = lines;
+        view.scanned = off;
+        pthread_mutex_unlock(&view.lock);
+    }
+    free(buf);
+
+    // A last line without a newline is still a line
+    char last;
+    if(view.size > 0 && pread(view.fd, &last, 1, view.size - 1) == 1 && last != '\n')
+        lines++;
+    pthread_mutex_lock(&view.lock);
+    view.lines = lines;
+    view.scanned = view.size;
+    view.done = 1;
+    pthread_mutex_unlock(&view.lock);
+    return NULL;
+}
+
+long long editorViewForward(long long off, long long n) {
+    // Where the line n lines after the one starting at off starts, or the end of the file
+    char *buf = malloc(KILO_VIEW_READ);
+    while(n > 0 && off < view.size) {
+        ssize_t got = pread(view.fd, buf, KILO_VIEW_READ, off);
+        if(got == -1 && errno == EINTR)
+            continue;
+        if(got <= 0)
+            break;
+        int count = editorCountByte(buf, got, '\n');
+        if(count < n) {
+            n -= count;
+            off += got;
+            continue;
+        }
+        char *p = buf;
+        while(n > 0) {
+            p = (char *)memchr(p, '\n', buf + got - p) + 1;
+            n--;
+        }
+        off += p - buf;
+    }
+    free(buf);
+    return (n > 0) ? view.size : off;
+}
+
+long long editorViewBack(long long off, int n, long long limit, int *moved) {
+    // Where the line n lines before the one starting at off starts, going back no more than limit bytes.  Short
+    // of that, where the furthest line found starts.  Lines gone back over are put in moved.  off can be the end
+    // of the file, which is after its last line
+    char *buf = malloc(KILO_VIEW_READ);
+    long long start = off;
+    // The newline just before off ends the previous line, so the search starts before it
+    long long end = off - 1;
+    long long stop = (off > limit) ? off - limit : 0;
+    int found = 0;
+    while(found < n && end > stop) {
+        long long from = (end - stop > KILO_VIEW_READ) ? end - KILO_VIEW_READ : stop;
+        ssize_t got = pread(view.fd, buf, end - from, from);
+        if(got == -1 && errno == EINTR)
+            continue;
+        if(got != end - from)
+            break;
+        char *p = buf + got;
+        while(found < n && (p = memrchr(buf, '\n', p - buf)) != NULL) {
+            found++;
+            start = from + (p - buf) + 1;
+        }
+        end = from;
+    }
+    free(buf);
+    // Back at the top, the first line of the file is one more
+    if(found < n && end <= 0 && off > 0) {
+        found++;
+        start = 0;
+    }
+    *moved = found;
+    return start;
+}
+
+long long editorViewCount(long long from, long long to) {
+    // Newlines between two offsets
+    char *buf = malloc(KILO_VIEW_READ);
+    long long lines = 0;
+    while(from < to) {
+        long long want = (to - from > KILO_VIEW_READ) ? KILO_VIEW_READ : to - from;
+        ssize_t got = pread(view.fd, buf, want, from);
+        if(got == -1 && errno == EINTR)
+            continue;
+        if(got <= 0)
+            break;
+        lines += editorCountByte(buf, got, '\n');
+        from += got;
+    }
+    free(buf);
+    return lines;
+}
+
+void editorViewLoad(long long start, long long line) {
+    // Make the window the lines from start on: as many as fit in KILO_VIEW_ROWS rows and a span of the file
+    if(editorNumRows() > 0)
+        editorDeleteRows(0, editorNumRows());
+    if(view.map)
+        munmap(view.map, view.maplen);
+    view.map = NULL;
+    view.maplen = 0;
+
+    // Mappings have to start on a page
+    view.mapoff = start & ~(long long)(sysconf(_SC_PAGESIZE) - 1);
+    long long to = start + KILO_VIEW_SPAN;
+    if(to > view.size)
+        to = view.size;
+    if(to > view.mapoff) {
+        view.maplen = to - view.mapoff;
+        view.map = mmap(NULL, view.maplen, PROT_READ, MAP_PRIVATE, view.fd, view.mapoff);
+        if(view.map == MAP_FAILED)
+            die("mmap");
+    }
+
+    char *p = view.map + (start - view.mapoff);
+    char *end = view.map + view.maplen;
+    while(p < end && editorNumRows() < KILO_VIEW_ROWS) {
+        char *nl = memchr(p, '\n', end - p);
+        // A line cut off by the end of the span is left for the next window.  One longer than the whole span
+        // is shown in pieces
+        if(nl == NULL && to < view.size && editorNumRows() > 0)
+            break;
+        char *next = nl ? nl + 1 : end;
+        size_t linelen = (nl ? nl : end) - p;
+        while(linelen > 0 && p[linelen - 1] == '\r')
+            linelen--;
+        editorInsertMappedRow(editorNumRows(), p, linelen);
+        p = next;
+    }
+    view.start = start;
+    view.end = view.mapoff + (p - view.map);
+    view.line = line;
+    E.dirty = 0;
+
+    // Keep the cursor inside what was loaded
+    if(E.cy > editorNumRows())
+        E.cy = editorNumRows();
+    if(E.rowoff > E.cy)
+        E.rowoff = E.cy;
+    erow *row = editorRowAt(E.cy);
+    if(E.cx > (row ? row->size : 0))
+        E.cx = row ? row->size : 0;
+}
+
+long long editorViewRowStart(int at) {
+    // File offset of a row in the window
+    return view.mapoff + (editorRowAt(at)->chars - view.map);
+}
+
+void editorViewSlide() {
+    // Move the window on when the screen is less than a quarter of it from either end, keeping the same lines
+    // on screen
+    int margin = KILO_VIEW_ROWS / 4;
+    if(E.rowoff + E.screenrows + margin > editorNumRows() && view.end < view.size) {
+        // Start the window a margin above the screen
+        int drop = E.rowoff - margin;
+        if(drop <= 0)
+            drop = E.rowoff;
+        // Lines so long that the window is less than a screen: start from the cursor
+        if(drop == 0)
+            drop = E.cy;
+        if(drop == 0)
+            return;
+        long long start = (drop < editorNumRows()) ? editorViewRowStart(drop) : view.end;
+        // Carrying on with a line cut off at the end of the span, which is still the same line
+        int cut = (start == view.end && view.map[view.end - 1 - view.mapoff] != '\n');
+        E.cy -= drop;
+        E.rowoff = (E.rowoff > drop) ? E.rowoff - drop : 0;
+        editorViewLoad(start, (view.line < 0) ? -1 : view.line + drop - cut);
+    } else if(E.rowoff < margin && view.start > 0) {
+        // Start the window far enough up that the screen is in the middle of it
+        // Not so far up in bytes that the window wouldn't reach the screen
+        int moved;
+        long long start = editorViewBack(view.start, KILO_VIEW_ROWS / 2, KILO_VIEW_SPAN / 2, &moved);
+        if(moved == 0)
+            return;
+        E.cy += moved;
+        E.rowoff += moved;
+        editorViewLoad(start, (start == 0) ? 0 : (view.line < 0) ? -1 : view.line - moved);
+    }
+}
+
+long long editorViewIndexed(long long line) {
+    // Where a line starts, if the index has got that far, otherwise -1
+    pthread_mutex_lock(&view.lock);
+    long long off = -1;
+    long long k = line / KILO_VIEW_STRIDE;
+    if((line < view.lines || view.done) && k < view.noffsets)
+        off = view.offsets[k];
+    pthread_mutex_unlock(&view.lock);
+    if(off < 0)
+        return -1;
+    return editorViewForward(off, line - k * KILO_VIEW_STRIDE);
+}
+
+void editorViewJump(long long start, long long line, int cy) {
+    // Load a window and put the cursor on row cy of it.  Like editorScroll, a line further up ends up at the
+    // top of the screen and one further down at the bottom
+    long long top = (view.line < 0) ? -1 : view.line + E.rowoff;
+    int up = line >= 0 && (top < 0 || line + cy < top);
+    if(cy < 0)
+        cy = 0;
+    E.cy = 0;
+    E.cx = 0;
+    E.rowoff = 0;
+    editorViewLoad(start, line);
+    E.cy = (cy < editorNumRows()) ? cy : editorNumRows();
+    E.rowoff = up ? E.cy : (E.cy >= E.screenrows ? E.cy - E.screenrows + 1 : 0);
+}
+
+void editorViewGoto(char *query) {
+    // Go to line, or to the end for $
+    if(!strcmp(query, "$") || (view.indexed && atoll(query) > view.total)) {
+        // The last three quarters of a window before the end of the file
+        int moved;
+        long long start = editorViewBack(view.size, KILO_VIEW_ROWS - KILO_VIEW_ROWS / 4, KILO_VIEW_SPAN, &moved);
+        long long line = (start == 0) ? 0 : view.indexed ? view.total - moved : -1;
+        // A last line longer than the span: show the end of it
+        if(moved == 0 && view.size > 0) {
+            start = (view.size > KILO_VIEW_SPAN / 2) ? view.size - KILO_VIEW_SPAN / 2 : 0;
+            line = -1;
+            moved = 1;
+        }
+        editorViewJump(start, line, moved - 1);
+        return;
+    }
+    long long line = atoll(query) - 1;
+    if(line < 0)
+        line = 0;
+    // A quarter of a window above the line, so there is room to scroll both ways
+    long long first = (line > KILO_VIEW_ROWS / 4) ? line - KILO_VIEW_ROWS / 4 : 0;
+    long long start = editorViewIndexed(first);
+    if(start < 0) {
+        editorSetStatusMessage("Line %lld isn't indexed yet, only %lld lines so far", line + 1, view.total);
+        return;
+    }
+    editorViewJump(start, first, line - first);
+}
+
+int editorViewPoll() {
+    // Catch up with the index thread from the main loop.  Returns 1 if the status bar changed
+    if(!view.on || view.indexed)
+        return 0;
+    pthread_mutex_lock(&view.lock);
+    view.total = view.lines;
+    int percent = view.size ? (int)(view.scanned * 100 / view.size) : 100;
+    int done = view.done;
+    pthread_mutex_unlock(&view.lock);
+    if(!done && percent == view.percent)
+        return 0;
+    view.percent = percent;
+    if(done) {
+        view.indexed = 1;
+        // Number the window now, if it was jumped to: every stride up to its start is in the index
+        if(view.line < 0) {
+            int lo = 0, hi = view.noffsets - 1;
+            while(lo < hi) {
+                int mid = (lo + hi + 1) / 2;
+                if(view.offsets[mid] <= view.start)
+                    lo = mid;
+                else
+                    hi = mid - 1;
+            }
+            view.line = (long long)lo * KILO_VIEW_STRIDE + editorViewCount(view.offsets[lo], view.start);
+        }
+    }
+    return 1;
+}
+
+int editorViewAllows(int key) {
+    // Keys that don't change the file
+    switch(key) {
+        case CTRL_KEY('q'):
+        case CTRL_KEY('g'):
+        case CTRL_KEY('l'):
+        case CTRL_KEY('t'):
+        case HOME_KEY:
+        case END_KEY:
+        case PAGE_UP:
+        case PAGE_DOWN:
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case ALT_UP:
+        case ALT_DOWN:
+        case '\x1b':
+            return 1;
+    }
+    return 0;
+}
+
+void editorViewOpen(char *filename) {
+    // Open a file to view: index it in the background and show the first window straight away
+    free(E.filename);
+    E.filename = strdup(filename);
+    editorSelectSyntaxHighlight();
+
+    view.fd = open(filename, O_RDONLY);
+    if(view.fd == -1)
+        die("open");
+    struct stat st;
+    if(fstat(view.fd, &st) == -1)
+        die("fstat");
+    view.size = st.st_size;
+    view.on = 1;
+
+    view.capoffsets = 1024;
+    view.offsets = malloc(view.capoffsets * sizeof(long long));
+    view.offsets[0] = 0;
+    view.noffsets = 1;
+    view.percent = -1;
+    if(pthread_create(&view.thread, NULL, editorViewThread, NULL) != 0)
+        die("pthread_create");
+    pthread_detach(view.thread);
+
+    editorViewLoad(0, 0);
+}
+
+/* Chunked storage */
+// With --chunked a file too big for memory can still be edited.  It is split into chunks, one for each
+// KILO_CHUNK_SIZE bytes of the file, holding the lines that start in those bytes.  Only a window of neighbouring
+// chunks is in the row tree at once, moved along as the screen nears either end of it.  A chunk that hasn't been
+// changed is mapped from the file again whenever it is needed.  A changed one is packed into a buffer when it
+// leaves the window, and once those buffers add up to more than the chunkmemory setting, the least recently used
+// are written out to a spill file.  A thread counts the lines in each chunk so lines can be numbered and gone to.
+// Saving writes the chunks before the window, the window's rows, then the chunks after it.  Undo history is
+// kept as the window moves, except for edits to rows that leave it, and there is no journal
+#define CHUNK_DISK 0
+#define CHUNK_MEMORY 1
+#define CHUNK_SPILLED 2
+
+struct chunk {
+    // CHUNK_* - where the text is while the chunk is out of the window
+    int state;
+    // In the window now
+    int loaded;
+    // Lines in it, -1 until counted
+    int lines;
+    // Where its first line starts in the file, -1 until looked for
+    long long off;
+    // Changed text, in memory or at spill in the spill file
+    char *text;
+    long long size;
+    long long spill;
+    // When it was last in the window, for choosing what to spill
+    long long used;
+};
+
+// A chunk in the window: whether its rows have changed, and the mapping they point into if it is on disk
+struct chunkSlot {
+    int chunk;
+    int changed;
+    char *map;
+    size_t maplen;
+};
+
+// Memory a running save may still be reading: let go of when it finishes.  len is 0 for malloc'd buffers
+struct chunkRetired {
+    void *p;
+    size_t len;
+};
+
+struct chunkStore {
+    int on;
+    int fd;
+    long long size;
+    struct chunk *chunks;
+    int n;
+    // The window, in file order
+    struct chunkSlot *slots;
+    int nslots;
+    int capslots;
+    // Set while rows are put in or taken out for the window, so that doesn't count as editing
+    int loading;
+    // Bytes of changed chunks in memory, and the spill file, -1 until it is first needed
+    long long memory;
+    int spillfd;
+    long long spillsize;
+    long long clock;
+    struct chunkRetired *retired;
+    int nretired;
+    int capretired;
+    // Line counting thread: lines in each chunk of the file, filled in up to counted under lock.  The main
+    // thread has taken in the ones before polled
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int *original;
+    int counted;
+    int polled;
+};
+
+struct chunkStore store = {0, -1, 0, NULL, 0, NULL, 0, 0, 0, 0, -1, 0, 0, NULL, 0, 0, 0,
+    PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+
+void *editorChunkThread(void *unused) {
+    // Count the lines starting in each chunk's bytes: the first byte of the file, and every byte after a
+    // newline but the end of the file
+    (void)unused;
+    char *buf = malloc(KILO_CHUNK_SIZE);
+    for(int k = 0; k < store.n; k++) {
+        long long from = k ? (long long)k * KILO_CHUNK_SIZE - 1 : 0;
+        long long to = (long long)(k + 1) * KILO_CHUNK_SIZE;
+        if(to > store.size)
+            to = store.size;
+        to--;
+        int lines = (k == 0 && store.size > 0);
+        if(to > from) {
+            if(editorPreadAll(store.fd, buf, to - from, from) == -1)
+                break;
+            lines += editorCountByte(buf, to - from, '\n');
+        }
+        pthread_mutex_lock(&store.lock);
+        store.original[k] = lines;
+        store.counted = k + 1;
+        pthread_mutex_unlock(&store.lock);
+    }
+    free(buf);
+    return NULL;
+}
+
+long long editorChunkStart(int k) {
+    // Where the first line of chunk k starts: the first line to start in its bytes or after.  The end of the
+    // file for a chunk with no lines at the end of it
+    if(k >= store.n)
+        return store.size;
+    struct chunk *c = &store.chunks[k];
+    if(c->off >= 0)
+        return c->off;
+    c->off = store.size;
+    if(k == 0) {
+        c->off = 0;
+        return 0;
+    }
+    char buf[4096];
+    long long at = (long long)k * KILO_CHUNK_SIZE - 1;
+    while(at < store.size) {
+        ssize_t got = pread(store.fd, buf, sizeof(buf), at);
+        if(got == -1 && errno == EINTR)
+            continue;
+        if(got <= 0)
+            break;
+        char *nl = memchr(buf, '\n', got);
+        if(nl) {
+            c->off = at + (nl - buf) + 1;
+            break;
+        }
+        at += got;
+    }
+    return c->off;
+}
+
+void editorChunkRelease(void *p, size_t len) {
+    // Free a chunk buffer, or unmap a chunk mapping if len isn't 0.  Not yet if a save might be reading it
+    if(p == NULL)
+        return;
+    if(E.save) {
+        if(store.nretired == store.capretired) {
+            store.capretired = store.capretired ? store.capretired * 2 : 16;
+            store.retired = realloc(store.retired, sizeof(struct chunkRetired) * store.capretired);
+        }
+        store.retired[store.nretired].p = p;
+        store.retired[store.nretired].len = len;
+        store.nretired++;
+    } else if(len) {
+        munmap(p, len);
+    } else {
+        free(p);
+    }
+}
+
+void editorChunkSaved() {
+    // A save has finished: let go of what it was holding on to
+    struct chunkRetired *retired = store.retired;
+    int n = store.nretired;
+    store.retired = NULL;
+    store.nretired = store.capretired = 0;
+    for(int i = 0; i < n; i++) {
+        editorChunkRelease(retired[i].p, retired[i].len);
+    }
+    free(retired);
+}
+
+void editorChunkUndoMove(int lines, int front) {
+    // Line the undo log up with the window after lines rows have come (lines > 0) or gone (lines < 0) at its
+    // front or back.  Rows are counted from the top of the window, so the operations are moved along with the
+    // rows at the front.  Operations on rows that have gone are dropped, along with the ones that would have to be
+    // undone or redone on the way to them
+    int lo = 0;
+    int hi = undo.used;
+    if(lines < 0) {
+        // Walk back from the newest applied operation, keeping where the cut was before each one.  The front of
+        // the window is at the same row in every state the log steps through, as long as no edit went past it
+        int cut = front ? -lines : editorNumRows();
+        for(int off = undo.last; off >= 0; off = editorUndoOp(off)->prev) {
+            struct undoOp *op = editorUndoOp(off);
+            int n = editorUndoLines(op);
+            int gone = front ? (op->row < cut) : (op->row + ((op->type == UNDO_INSERT) ? n : 0) >= cut);
+            if(gone) {
+                lo = editorUndoEnd(off);
+                break;
+            }
+            if(!front)
+                cut += (op->type == UNDO_INSERT) ? -n : n;
+        }
+        // Then forward through what can be redone
+        cut = front ? -lines : editorNumRows();
+        for(int off = editorUndoEnd(undo.last); off < undo.used; off = editorUndoEnd(off)) {
+            struct undoOp *op = editorUndoOp(off);
+            int n = editorUndoLines(op);
+            int gone = front ? (op->row < cut) : (op->row + ((op->type == UNDO_DELETE) ? n : 0) >= cut);
+            if(gone) {
+                hi = off;
+                break;
+            }
+            if(!front)
+                cut += (op->type == UNDO_INSERT) ? n : -n;
+        }
+    }
+
+    // Slide what is kept to the start of the arena
+    if(lo > 0 || hi < undo.used) {
+        editorSetStatusMessage("Undo history for rows paged out of the window dropped");
+        if(undo.last < lo) {
+            undo.last = -1;
+            undo.open = 0;
+        } else {
+            undo.last -= lo;
+        }
+        memmove(undo.arena, &undo.arena[lo], hi - lo);
+        undo.used = hi - lo;
+        for(int off = 0; off < undo.used; off = editorUndoEnd(off)) {
+            struct undoOp *op = editorUndoOp(off);
+            op->prev = (off == 0) ? -1 : op->prev - lo;
+        }
+    }
+    if(front) {
+        for(int off = 0; off < undo.used; off = editorUndoEnd(off)) {
+            editorUndoOp(off)->row += lines;
+        }
+    }
+}
+
+void editorChunkSpill() {
+    // Write the least recently used changed chunks to the spill file until the rest fit in chunkmemory
+    while(store.memory > (long long)U.chunkMemory << 20) {
+        struct chunk *lru = NULL;
+        for(int k = 0; k < store.n; k++) {
+            struct chunk *c = &store.chunks[k];
+            if(c->state == CHUNK_MEMORY && !c->loaded && (lru == NULL || c->used < lru->used))
+                lru = c;
+        }
+        if(lru == NULL)
+            return;
+        if(store.spillfd == -1) {
+            // Unlinked straight away, so it goes when the editor does
+            const char *dir = getenv("TMPDIR");
+            char *path = malloc(strlen(dir ? dir : "/tmp") + 24);
+            sprintf(path, "%s/kilo-spill-XXXXXX", dir ? dir : "/tmp");
+            store.spillfd = mkstemp(path);
+            if(store.spillfd != -1)
+                unlink(path);
+            free(path);
+            if(store.spillfd == -1) {
+                editorSetStatusMessage("Can't spill to disk! %s", strerror(errno));
+                return;
+            }
+        }
+        struct iovec iov = {lru->text, lru->size};
+        if(lseek(store.spillfd, store.spillsize, SEEK_SET) == -1 || editorWriteAll(store.spillfd, &iov, 1) == -1) {
+            editorSetStatusMessage("Can't spill to disk! %s", strerror(errno));
+            return;
+        }
+        lru->spill = store.spillsize;
+        store.spillsize += lru->size;
+        store.memory -= lru->size;
+        editorChunkRelease(lru->text, 0);
+        lru->text = NULL;
+        lru->state = CHUNK_SPILLED;
+    }
+}
+
+void editorChunkLoad(int k, int front) {
+    // Bring chunk k into the window, at its front or back
+    struct chunk *c = &store.chunks[k];
+    struct chunkSlot slot = {k, 0, NULL, 0};
+    if(c->state == CHUNK_SPILLED) {
+        // Read it back.  It stays in memory until it is spilled again
+        char *text = malloc(c->size ? c->size : 1);
+        if(editorPreadAll(store.spillfd, text, c->size, c->spill) == -1)
+            die("pread");
+        c->text = text;
+        c->state = CHUNK_MEMORY;
+        store.memory += c->size;
+    }
+    char *p = NULL;
+    char *end = NULL;
+    if(c->state == CHUNK_MEMORY) {
+        p = c->text;
+        end = p + c->size;
+    } else {
+        long long start = editorChunkStart(k);
+        long long stop = editorChunkStart(k + 1);
+        if(stop > start) {
+            // Mappings have to start on a page
+            long long from = start & ~(long long)(sysconf(_SC_PAGESIZE) - 1);
+            slot.maplen = stop - from;
+            slot.map = mmap(NULL, slot.maplen, PROT_READ, MAP_PRIVATE, store.fd, from);
+            if(slot.map == MAP_FAILED)
+                die("mmap");
+            p = slot.map + (start - from);
+            end = slot.map + slot.maplen;
+        }
+    }
+
+    // Split into rows that point into the text, as editorOpen does
+    int at = front ? 0 : editorNumRows();
+    int rows = 0;
+    int dirty = E.dirty;
+    store.loading = 1;
+    while(p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        char *next = nl ? nl + 1 : end;
+        size_t linelen = (nl ? nl : end) - p;
+        while(linelen > 0 && p[linelen - 1] == '\r')
+            linelen--;
+        editorInsertMappedRow(at + rows++, p, linelen);
+        p = next;
+    }
+    store.loading = 0;
+    E.dirty = dirty;
+    c->lines = rows;
+    c->loaded = 1;
+    c->used = ++store.clock;
+
+    if(store.nslots == store.capslots) {
+        store.capslots = store.capslots ? store.capslots * 2 : 8;
+        store.slots = realloc(store.slots, sizeof(struct chunkSlot) * store.capslots);
+    }
+    if(front) {
+        memmove(&store.slots[1], &store.slots[0], sizeof(struct chunkSlot) * store.nslots);
+        store.slots[0] = slot;
+        editorChunkUndoMove(rows, 1);
+    } else {
+        store.slots[store.nslots] = slot;
+    }
+    store.nslots++;
+}
+
+void editorChunkUnload(int i) {
+    // Take the chunk in window slot i out of the tree, packing its rows into a buffer if they have changed
+    struct chunkSlot *slot = &store.slots[i];
+    struct chunk *c = &store.chunks[slot->chunk];
+    int at = 0;
+    for(int j = 0; j < i; j++) {
+        at += store.chunks[store.slots[j].chunk].lines;
+    }
+    char *old = NULL;
+    if(slot->changed) {
+        long long size = 0;
+        erow *row = c->lines ? editorRowAt(at) : NULL;
+        for(int j = 0; j < c->lines; j++, row = editorRowNext(row)) {
+            size += row->size + 1;
+        }
+        char *text = malloc(size ? size : 1);
+        char *p = text;
+        row = c->lines ? editorRowAt(at) : NULL;
+        for(int j = 0; j < c->lines; j++, row = editorRowNext(row)) {
+            memcpy(p, row->chars, row->gap);
+            memcpy(p + row->gap, &row->chars[row->gap + row->gaplen], row->size - row->gap);
+            p += row->size;
+            *p++ = '\n';
+        }
+        // The old text can only go once no row points into it
+        if(c->state == CHUNK_MEMORY) {
+            old = c->text;
+            store.memory -= c->size;
+        }
+        c->state = CHUNK_MEMORY;
+        c->text = text;
+        c->size = size;
+        store.memory += size;
+    }
+
+    int dirty = E.dirty;
+    store.loading = 1;
+    if(c->lines)
+        editorDeleteRows(at, c->lines);
+    store.loading = 0;
+    E.dirty = dirty;
+    editorChunkRelease(old, 0);
+    editorChunkRelease(slot->map, slot->maplen);
+    c->loaded = 0;
+    c->used = ++store.clock;
+    memmove(&store.slots[i], &store.slots[i + 1], sizeof(struct chunkSlot) * (store.nslots - i - 1));
+    store.nslots--;
+    // With no other chunk left it counts as the back, and the whole log goes
+    editorChunkUndoMove(-c->lines, i == 0 && store.nslots > 0);
+    editorChunkSpill();
+}
+
+void editorChunkSlide() {
+    // Keep two screens of rows above and below the screen in the window, where the file has them, then drop
+    // chunks from whichever end can spare them until the window is back to KILO_CHUNK_WINDOW
+    int margin = E.screenrows * 2;
+    while(1) {
+        int first = store.slots[0].chunk;
+        int last = store.slots[store.nslots - 1].chunk;
+        if(E.rowoff + E.screenrows + margin > editorNumRows() && last + 1 < store.n) {
+            editorChunkLoad(last + 1, 0);
+        } else if(E.rowoff < margin && first > 0) {
+            editorChunkLoad(first - 1, 1);
+            E.cy += store.chunks[first - 1].lines;
+            E.rowoff += store.chunks[first - 1].lines;
+        } else {
+            break;
+        }
+    }
+    while(store.nslots > KILO_CHUNK_WINDOW) {
+        int front = store.chunks[store.slots[0].chunk].lines;
+        int back = store.chunks[store.slots[store.nslots - 1].chunk].lines;
+        int above = E.rowoff - front;
+        int below = editorNumRows() - back - E.rowoff - E.screenrows;
+        if(above >= margin && (above >= below || below < margin)) {
+            editorChunkUnload(0);
+            E.cy -= front;
+            E.rowoff -= front;
+        } else if(below >= margin) {
+            editorChunkUnload(store.nslots - 1);
+        } else {
+            break;
+        }
+    }
+}
+
+int editorChunkSlotAt(int at) {
+    // Window slot holding row at, or the last one for the row after the end
+    int start = 0;
+    for(int i = 0; i < store.nslots; i++) {
+        start += store.chunks[store.slots[i].chunk].lines;
+        if(at < start)
+            return i;
+    }
+    return store.nslots - 1;
+}
+
+void editorChunkRowChanged(int at) {
+    if(!store.on || store.loading)
+        return;
+    store.slots[editorChunkSlotAt(at)].changed = 1;
+}
+
+void editorChunkRowsInserted(int at, int count) {
+    // New rows belong to the chunk of the row they pushed down
+    if(!store.on || store.loading)
+        return;
+    struct chunkSlot *slot = &store.slots[editorChunkSlotAt(at)];
+    store.chunks[slot->chunk].lines += count;
+    slot->changed = 1;
+}
+
+void editorChunkRowsDeleted(int at, int count) {
+    // Rows can go from more than one chunk at once
+    if(!store.on || store.loading)
+        return;
+    int start = 0;
+    for(int i = 0; i < store.nslots && count > 0; i++) {
+        struct chunk *c = &store.chunks[store.slots[i].chunk];
+        int end = start + c->lines;
+        if(at < end) {
+            int n = (at + count < end) ? count : end - at;
+            c->lines -= n;
+            count -= n;
+            store.slots[i].changed = 1;
+            end -= n;
+        }
+        start = end;
+    }
+}
+
+long long editorChunkLinesBefore(int k) {
+    // Lines in the chunks before chunk k, or -1 if some aren't counted yet
+    long long lines = 0;
+    for(int j = 0; j < k; j++) {
+        if(store.chunks[j].lines < 0)
+            return -1;
+        lines += store.chunks[j].lines;
+    }
+    return lines;
+}
+
+void editorChunkJump(int k, int cy) {
+    // Put the cursor on row cy of chunk k.  Unless it is in the window already, the window becomes chunk k alone
+    // and the next refresh fills in around it
+    long long top = editorChunkLinesBefore(store.slots[0].chunk);
+    long long before = editorChunkLinesBefore(k);
+    int up = (top >= 0 && before >= 0) ? before + cy < top + E.rowoff : k < store.slots[0].chunk;
+    E.cx = 0;
+    if(store.chunks[k].loaded) {
+        // Already in the window: only the cursor moves, which keeps the undo log
+        for(int i = 0; store.slots[i].chunk != k; i++) {
+            cy += store.chunks[store.slots[i].chunk].lines;
+        }
+    } else {
+        E.cy = E.rowoff = 0;
+        while(store.nslots > 0) {
+            editorChunkUnload(store.nslots - 1);
+        }
+        editorChunkLoad(k, 0);
+    }
+    if(cy > editorNumRows())
+        cy = editorNumRows();
+    if(cy < 0)
+        cy = 0;
+    E.cy = cy;
+    // Like editorScroll: a line further up ends up at the top of the screen, one further down at the bottom
+    E.rowoff = up ? E.cy : (E.cy >= E.screenrows ? E.cy - E.screenrows + 1 : 0);
+}
+
+void editorChunkGoto(char *query) {
+    // Go to line, or to the end for $
+    if(strcmp(query, "$")) {
+        long long line = atoll(query) - 1;
+        if(line < 0)
+            line = 0;
+        long long before = 0;
+        for(int k = 0; k < store.n; k++) {
+            int lines = store.chunks[k].lines;
+            if(lines < 0) {
+                editorSetStatusMessage("Line %lld isn't counted yet, only %lld lines so far", line + 1, before);
+                return;
+            }
+            if(line < before + lines) {
+                editorChunkJump(k, line - before);
+                return;
+            }
+            before += lines;
+        }
+    }
+    // The end: the last line of the last chunk to have any
+    int k = store.n - 1;
+    while(k > 0 && store.chunks[k].lines == 0)
+        k--;
+    editorChunkJump(k, store.chunks[k].lines - 1);
+}
+
+int editorChunkPoll() {
+    // Take in the line counts the thread has finished since last time.  Returns 1 if there were any, for the
+    // status bar
+    if(!store.on || store.polled == store.n)
+        return 0;
+    pthread_mutex_lock(&store.lock);
+    int counted = store.counted;
+    pthread_mutex_unlock(&store.lock);
+    if(counted == store.polled)
+        return 0;
+    for(int k = store.polled; k < counted; k++) {
+        if(store.chunks[k].lines < 0)
+            store.chunks[k].lines = store.original[k];
+    }
+    store.polled = counted;
+    return 1;
+}
+
+void editorChunkExtents(struct saveJob *job) {
+    // Add the chunks outside the window to a save: where to find each one's text now.  Text held in memory stays
+    // put until the save is finished, and the file and spill file are never written over
+    if(!store.on)
+        return;
+    int first = store.slots[0].chunk;
+    int last = store.slots[store.nslots - 1].chunk;
+    job->extents = malloc(sizeof(struct saveExtent) * store.n);
+    job->nextents = 0;
+    for(int k = 0; k < store.n; k++) {
+        if(k == first)
+            job->split = job->nextents;
+        if(k >= first && k <= last)
+            continue;
+        struct chunk *c = &store.chunks[k];
+        struct saveExtent *ext = &job->extents[job->nextents];
+        ext->text = NULL;
+        if(c->state == CHUNK_MEMORY) {
+            ext->text = c->text;
+            ext->len = c->size;
+        } else if(c->state == CHUNK_SPILLED) {
+            ext->fd = store.spillfd;
+            ext->off = c->spill;
+            ext->len = c->size;
+        } else {
+            ext->fd = store.fd;
+            ext->off = editorChunkStart(k);
+            ext->len = editorChunkStart(k + 1) - ext->off;
+        }
+        if(ext->len == 0)
+            continue;
+        job->total += ext->len;
+        job->nextents++;
+    }
+}
+
+void editorChunkOpen(char *filename) {
+    // Open a file in chunks: count its lines in the background and load the first chunk straight away
+    free(E.filename);
+    E.filename = strdup(filename);
+    editorSelectSyntaxHighlight();
+
+    store.fd = open(filename, O_RDONLY);
+    if(store.fd == -1)
+        die("open");
+    struct stat st;
+    if(fstat(store.fd, &st) == -1)
+        die("fstat");
+    store.size = st.st_size;
+    store.n = store.size ? (store.size + KILO_CHUNK_SIZE - 1) / KILO_CHUNK_SIZE : 1;
+    store.chunks = malloc(sizeof(struct chunk) * store.n);
+    for(int k = 0; k < store.n; k++) {
+        struct chunk c = {CHUNK_DISK, 0, -1, -1, NULL, 0, 0, 0};
+        store.chunks[k] = c;
+    }
+    store.original = malloc(sizeof(int) * store.n);
+    store.on = 1;
+    // Entries would refer to rows of the window, which moves
+    journal.off = 1;
+    if(pthread_create(&store.thread, NULL, editorChunkThread, NULL) != 0)
+        die("pthread_create");
+    pthread_detach(store.thread);
+
+    editorChunkLoad(0, 0);
+}
+
+/* Worker pool */
+// Threads that share out a job cut into parts.  Whichever thread is free takes the next part; the thread that
+// started the job works on it too, and gets control back once every part is done
+struct workerPool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    // Threads started so far (not counting the caller)
+    int nthreads;
+    // Current job, and a count bumped for each new one
+    void (*fn)(void *arg, int part);
+    void *arg;
+    int parts;
+    int next;
+    int finished;
+    unsigned int gen;
+};
+
+struct workerPool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    0, NULL, NULL, 0, 0, 0, 0};
+
+void workerTakeParts() {
+    // Work through the job's parts until none are left.  Called and returns with the lock held
+    while(pool.next < pool.parts) {
+        int part = pool.next++;
+        pthread_mutex_unlock(&pool.lock);
+        pool.fn(pool.arg, part);
+        pthread_mutex_lock(&pool.lock);
+        if(++pool.finished == pool.parts)
+            pthread_cond_signal(&pool.done);
+    }
+}
+
+void *workerMain(void *unused) {
+    (void)unused;
+    unsigned int seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    while(1) {
+        while(pool.gen == seen)
+            pthread_cond_wait(&pool.work, &pool.lock);
+        seen = pool.gen;
+        workerTakeParts();
+    }
+    return NULL;
+}
+
+void workerPoolRun(void (*fn)(void *arg, int part), void *arg, int parts) {
+    // Run fn on every part from 0 to parts - 1, spread over U.findThreads threads.  Threads are started the
+    // first time they are needed and then wait for the next job
+    if(parts <= 1 || U.findThreads <= 1) {
+        for(int part = 0; part < parts; part++) {
+            fn(arg, part);
+        }
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    while(pool.nthreads < U.findThreads - 1) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, workerMain, NULL) != 0)
+            break;
+        pthread_detach(thread);
+        pool.nthreads++;
+    }
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.parts = parts;
+    pool.next = 0;
+    pool.finished = 0;
+    pool.gen++;
+    pthread_cond_broadcast(&pool.work);
+    workerTakeParts();
+    while(pool.finished < pool.parts)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Regex */
+// Regex search patterns: literals, ., [classes] and [^classes], \d \w \s and their capitals, ^ $, ( ), |,
+// * + ? and {m} {m,} {m,n}.  A pattern is parsed to a tree and compiled to NFA instructions, which are run as a
+// DFA whose states (sets of instructions) are only built as they are reached.  Matching never backtracks:
+// it costs one table lookup per byte once the states it needs exist
+
+enum regexOp {
+    RE_SET,
+    RE_SPLIT,
+    RE_JMP,
+    RE_BOL,
+    RE_EOL,
+    RE_MATCH
+};
+
+struct regexInst {
+    int op;
+    // Jump targets for RE_JMP and RE_SPLIT, byte set for RE_SET
+    int x, y;
+};
+
+// Node of a parsed pattern: a byte set, two children one after the other or either of, child a repeated
+// between min and max (-1 for no limit) times, an anchor, or nothing
+enum regexNodeType {
+    RN_SET,
+    RN_CAT,
+    RN_ALT,
+    RN_REPEAT,
+    RN_BOL,
+    RN_EOL,
+    RN_EMPTY
+};
+
+struct regexNode {
+    int type;
+    int a, b;
+    int min, max;
+    int set;
+};
+
+// Compiled pattern
+struct regex {
+    char *pattern;
+    struct regexInst *inst;
+    int ninst;
+    int capinst;
+    // Byte sets, 32 bytes (256 bits) each
+    unsigned char *sets;
+    int nsets;
+    int capsets;
+    // The same pattern compiled back to front (^ and $ swapped), for running from the end of a line to find
+    // where matches start.  Shares nothing with this one
+    struct regex *reverse;
+};
+
+struct regexParser {
+    const char *p;
+    struct regex *re;
+    struct regexNode *nodes;
+    int nnodes;
+    int capnodes;
+    int error;
+    // Compiling the pattern back to front
+    int reverse;
+};
+
+// DFA state: the sorted NFA instructions it stands for, whether a match ends here (or would if the line ended
+// here) and the state for each next byte, -1 until worked out
+struct regexState {
+    int *pcs;
+    int npcs;
+    int accept;
+    int accept_eol;
+    int next[256];
+};
+
+// DFA for a pattern.  An anchored DFA only matches from where it is started, the other kind finds matches
+// starting anywhere.  Each one is only used by one thread at a time
+struct regexDfa {
+    struct regex *re;
+    int anchored;
+    struct regexState *states;
+    int nstates;
+    int capstates;
+    // Hash table of states by instruction set, holding index + 1 (0 is empty)
+    int *table;
+    // Start states at the beginning of a line and elsewhere, -1 until built
+    int start[2];
+    // Bumped whenever the states are thrown away, which makes any state index held on to meaningless
+    int flushes;
+    // Unanchored DFAs spend most of their time in the "nothing matched yet" state.  idle_byte is the only byte
+    // that leads out of it (so memchr can skip to it), -2 if none does, -1 if there's more than one
+    int idle;
+    int idle_byte;
+    // Scratch space for building a state
+    unsigned int *mark;
+    unsigned int markgen;
+    int *stack;
+    int *set;
+    int nset;
+    // Unanchored DFAs of a reversed pattern: for each place in the last line given to regexStarts, 1 if a match
+    // starts there
+    char *starts;
+    int capstarts;
+};
+
+unsigned char *regexSetBits(struct regex *re, int set) {
+    return &re->sets[set * 32];
+}
+
+void regexSetAdd(unsigned char *bits, int c) {
+    bits[c >> 3] |= 1 << (c & 7);
+}
+
+int regexSetHas(const unsigned char *bits, int c) {
+    return bits[c >> 3] & (1 << (c & 7));
+}
+
+int regexNewSet(struct regex *re) {
+    if(re->nsets == re->capsets) {
+        re->capsets = re->capsets ? re->capsets * 2 : 16;
+        re->sets = realloc(re->sets, re->capsets * 32);
+    }
+    memset(&re->sets[re->nsets * 32], 0, 32);
+    return re->nsets++;
+}
+
+int regexNewNode(struct regexParser *rp, int type, int a, int b) {
+    if(rp->nnodes == rp->capnodes) {
+        rp->capnodes = rp->capnodes ? rp->capnodes * 2 : 32;
+        rp->nodes = realloc(rp->nodes, sizeof(struct regexNode) * rp->capnodes);
+    }
+    struct regexNode *node = &rp->nodes[rp->nnodes];
+    node->type = type;
+    node->a = a;
+    node->b = b;
+    node->min = node->max = 0;
+    node->set = -1;
+    return rp->nnodes++;
+}
+
+int regexClassEscape(unsigned char *bits, int c) {
+    // Add the bytes of class escape \c to bits.  Returns 0 if c isn't a class escape
+    int lower = tolower(c);
+    if(lower != 'd' && lower != 'w' && lower != 's')
+        return 0;
+    unsigned char class[32];
+    memset(class, 0, sizeof(class));
+    for(int j = 0; j < 256; j++) {
+        if((lower == 'd' && isdigit(j)) || (lower == 'w' && (isalnum(j) || j == '_')) ||
+            (lower == 's' && j != '\n' && isspace(j)))
+            regexSetAdd(class, j);
+    }
+    for(int j = 0; j < 32; j++) {
+        bits[j] |= (c == lower) ? class[j] : (unsigned char)~class[j];
+    }
+    return 1;
+}
+
+int regexEscapeByte(int c) {
+    // Byte meant by \c when it isn't a class
+    switch(c) {
+        case 't': return '\t';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        default: return c;
+    }
+}
+
+int regexParseAlt(struct regexParser *rp);
+
+int regexParseClass(struct regexParser *rp) {
+    // [...] with rp->p just past the [.  Ranges, escapes and a leading ^ to negate
+    int set = regexNewSet(rp->re);
+    unsigned char bits[32];
+    memset(bits, 0, sizeof(bits));
+    int negate = 0;
+    if(*rp->p == '^') {
+        negate = 1;
+        rp->p++;
+    }
+    int first = 1;
+    while(*rp->p && (*rp->p != ']' || first)) {
+        first = 0;
+        int lo = (unsigned char)*rp->p++;
+        if(lo == '\\') {
+            if(*rp->p == '\0')
+                break;
+            int c = (unsigned char)*rp->p++;
+            if(regexClassEscape(bits, c))
+                continue;
+            lo = regexEscapeByte(c);
+        }
+        int hi = lo;
+        if(rp->p[0] == '-' && rp->p[1] && rp->p[1] != ']') {
+            hi = (unsigned char)rp->p[1];
+            rp->p += 2;
+            if(hi == '\\' && *rp->p)
+                hi = regexEscapeByte((unsigned char)*rp->p++);
+            if(hi < lo) {
+                rp->error = 1;
+                return -1;
+            }
+        }
+        for(int c = lo; c <= hi; c++) {
+            regexSetAdd(bits, c);
+        }
+    }
+    if(*rp->p != ']') {
+        rp->error = 1;
+        return -1;
+    }
+    rp->p++;
+    if(negate) {
+        for(int j = 0; j < 32; j++) {
+            bits[j] = ~bits[j];
+        }
+    }
+    memcpy(regexSetBits(rp->re, set), bits, 32);
+    return set;
+}
+
+int regexParseAtom(struct regexParser *rp) {
+    int c = (unsigned char)*rp->p++;
+    int node;
+    switch(c) {
+        case '(':
+            node = regexParseAlt(rp);
+            if(*rp->p != ')') {
+                rp->error = 1;
+                return node;
+            }
+            rp->p++;
+            return node;
+        case '^':
+            return regexNewNode(rp, RN_BOL, -1, -1);
+        case '$':
+            return regexNewNode(rp, RN_EOL, -1, -1);
+        case '*':
+        case '+':
+        case '?':
+            // Nothing to repeat
+            rp->error = 1;
+            return regexNewNode(rp, RN_EMPTY, -1, -1);
+    }
+    node = regexNewNode(rp, RN_SET, -1, -1);
+    if(c == '[') {
+        rp->nodes[node].set = regexParseClass(rp);
+        return node;
+    }
+    int set = regexNewSet(rp->re);
+    rp->nodes[node].set = set;
+    unsigned char *bits = regexSetBits(rp->re, set);
+    if(c == '.') {
+        memset(bits, 0xff, 32);
+    } else if(c == '\\') {
+        if(*rp->p == '\0') {
+            rp->error = 1;
+            return node;
+        }
+        c = (unsigned char)*rp->p++;
+        if(!regexClassEscape(bits, c))
+            regexSetAdd(bits, regexEscapeByte(c));
+    } else {
+        regexSetAdd(bits, c);
+    }
+    return node;
+}
+
+int regexParseCount(struct regexParser *rp) {
+    // Number in a {m,n} repeat, -1 if there isn't one
+    if(!isdigit((unsigned char)*rp->p))
+        return -1;
+    int n = 0;
+    while(isdigit((unsigned char)*rp->p)) {
+        n = n * 10 + (*rp->p++ - '0');
+        if(n > KILO_REGEX_REPEAT)
+            rp->error = 1;
+    }
+    return n;
+}
+
+int regexParseRepeat(struct regexParser *rp) {
+    int node = regexParseAtom(rp);
+    while(!rp->error && (*rp->p == '*' || *rp->p == '+' || *rp->p == '?' || *rp->p == '{')) {
+        int min, max;
+        char c = *rp->p++;
+        if(c == '*') {
+            min = 0;
+            max = -1;
+        } else if(c == '+') {
+            min = 1;
+            max = -1;
+        } else if(c == '?') {
+            min = 0;
+            max = 1;
+        } else {
+            min = regexParseCount(rp);
+            max = min;
+            if(*rp->p == ',') {
+                rp->p++;
+                max = regexParseCount(rp);
+            }
+            if(min < 0 || *rp->p != '}' || (max != -1 && max < min)) {
+                rp->error = 1;
+                return node;
+            }
+            rp->p++;
+        }
+        int rep = regexNewNode(rp, RN_REPEAT, node, -1);
+        rp->nodes[rep].min = min;
+        rp->nodes[rep].max = max;
+        node = rep;
+    }
+    return node;
+}
+
+int regexParseCat(struct regexParser *rp) {
+    int node = regexNewNode(rp, RN_EMPTY, -1, -1);
+    while(!rp->error && *rp->p && *rp->p != '|' && *rp->p != ')') {
+        int next = regexParseRepeat(rp);
+        node = regexNewNode(rp, RN_CAT, node, next);
+    }
+    return node;
+}
+
+int regexParseAlt(struct regexParser *rp) {
+    int node = regexParseCat(rp);
+    while(!rp->error && *rp->p == '|') {
+        rp->p++;
+        int next = regexParseCat(rp);
+        node = regexNewNode(rp, RN_ALT, node, next);
+    }
+    return node;
+}
+
+int regexEmit(struct regex *re, int op, int x, int y) {
+    if(re->ninst == re->capinst) {
+        re->capinst = re->capinst ? re->capinst * 2 : 64;
+        re->inst = realloc(re->inst, sizeof(struct regexInst) * re->capinst);
+    }
+    re->inst[re->ninst].op = op;
+    re->inst[re->ninst].x = x;
+    re->inst[re->ninst].y = y;
+    return re->ninst++;
+}
+
+void regexCompileNode(struct regexParser *rp, int n) {
+    // Emit the instructions for node n.  Gives up once the program gets too big (large repeat counts)
+    struct regex *re = rp->re;
+    struct regexNode node = rp->nodes[n];
+    if(re->ninst > KILO_REGEX_INST) {
+        rp->error = 1;
+        return;
+    }
+    switch(node.type) {
+        case RN_SET:
+            regexEmit(re, RE_SET, node.set, 0);
+            break;
+        case RN_CAT:
+            regexCompileNode(rp, rp->reverse ? node.b : node.a);
+            regexCompileNode(rp, rp->reverse ? node.a : node.b);
+            break;
+        case RN_ALT: {
+            int split = regexEmit(re, RE_SPLIT, 0, 0);
+            re->inst[split].x = re->ninst;
+            regexCompileNode(rp, node.a);
+            int jmp = regexEmit(re, RE_JMP, 0, 0);
+            re->inst[split].y = re->ninst;
+            regexCompileNode(rp, node.b);
+            re->inst[jmp].x = re->ninst;
+            break;
+        }
+        case RN_REPEAT: {
+            for(int j = 0; j < node.min; j++) {
+                regexCompileNode(rp, node.a);
+            }
+            if(node.max == -1) {
+                // Loop: either go round once more or carry on
+                int split = regexEmit(re, RE_SPLIT, 0, 0);
+                re->inst[split].x = re->ninst;
+                regexCompileNode(rp, node.a);
+                regexEmit(re, RE_JMP, split, 0);
+                re->inst[split].y = re->ninst;
+            } else {
+                // Each optional copy can skip straight to the end
+                int optional = node.max - node.min;
+                int *splits = malloc(sizeof(int) * (optional ? optional : 1));
+                for(int j = 0; j < optional; j++) {
+                    splits[j] = regexEmit(re, RE_SPLIT, 0, 0);
+                    re->inst[splits[j]].x = re->ninst;
+                    regexCompileNode(rp, node.a);
+                }
+                for(int j = 0; j < optional; j++) {
+                    re->inst[splits[j]].y = re->ninst;
+                }
+                free(splits);
+            }
+            break;
+        }
+        case RN_BOL:
+            regexEmit(re, rp->reverse ? RE_EOL : RE_BOL, 0, 0);
+            break;
+        case RN_EOL:
+            regexEmit(re, rp->reverse ? RE_BOL : RE_EOL, 0, 0);
+            break;
+    }
+}
+
+void regexFree(struct regex *re) {
+    if(re == NULL)
+        return;
+    free(re->pattern);
+    free(re->inst);
+    free(re->sets);
+    regexFree(re->reverse);
+    free(re);
+}
+
+struct regex *regexCompile(const char *pattern) {
+    // Compile pattern, or return NULL if it isn't valid
+    struct regex *re = calloc(1, sizeof(struct regex));
+    re->pattern = strdup(pattern);
+    struct regexParser rp;
+    rp.p = pattern;
+    rp.re = re;
+    rp.nodes = NULL;
+    rp.nnodes = rp.capnodes = 0;
+    rp.error = 0;
+    rp.reverse = 0;
+    int root = regexParseAlt(&rp);
+    // A ) with no ( to match
+    if(*rp.p)
+        rp.error = 1;
+    if(!rp.error)
+        regexCompileNode(&rp, root);
+    regexEmit(re, RE_MATCH, 0, 0);
+    if(!rp.error) {
+        // Then backwards, with its own copy of the byte sets
+        struct regex *rev = calloc(1, sizeof(struct regex));
+        rev->pattern = strdup(pattern);
+        rev->sets = malloc(re->nsets * 32);
+        if(re->nsets)
+            memcpy(rev->sets, re->sets, re->nsets * 32);
+        rev->nsets = rev->capsets = re->nsets;
+        rp.re = rev;
+        rp.reverse = 1;
+        regexCompileNode(&rp, root);
+        regexEmit(rev, RE_MATCH, 0, 0);
+        re->reverse = rev;
+    }
+    free(rp.nodes);
+    if(rp.error) {
+        regexFree(re);
+        return NULL;
+    }
+    return re;
+}
+
+struct regexDfa *regexDfaNew(struct regex *re, int anchored) {
+    struct regexDfa *d = calloc(1, sizeof(struct regexDfa));
+    d->re = re;
+    d->anchored = anchored;
+    d->table = calloc(KILO_REGEX_STATES * 2, sizeof(int));
+    d->start[0] = d->start[1] = -1;
+    d->idle = -1;
+    d->mark = calloc(re->ninst, sizeof(unsigned int));
+    d->stack = malloc(sizeof(int) * re->ninst * 2);
+    d->set = malloc(sizeof(int) * re->ninst);
+    return d;
+}
+
+void regexDfaFlush(struct regexDfa *d) {
+    // Throw away every state, when a pattern needs more than KILO_REGEX_STATES of them
+    for(int j = 0; j < d->nstates; j++) {
+        free(d->states[j].pcs);
+    }
+    d->nstates = 0;
+    memset(d->table, 0, sizeof(int) * KILO_REGEX_STATES * 2);
+    d->start[0] = d->start[1] = -1;
+    d->idle = -1;
+    d->flushes++;
+}
+
+void regexDfaFree(struct regexDfa *d) {
+    if(d == NULL)
+        return;
+    regexDfaFlush(d);
+    free(d->states);
+    free(d->table);
+    free(d->mark);
+    free(d->stack);
+    free(d->set);
+    free(d->starts);
+    free(d);
+}
+
+// Where regexAddClosure is adding instructions: ^ and $ can only be passed at one
+#define RE_AT_BOL 1
+#define RE_AT_EOL 2
+
+void regexAddClosure(struct regexDfa *d, int pc, int at) {
+    // Add pc to the set being built, following jumps and splits, and anchors where they hold.
+    // Only instructions that wait for input or the end of the line, or match, go in the set
+    struct regexInst *inst = d->re->inst;
+    int sp = 0;
+    d->stack[sp++] = pc;
+    while(sp > 0) {
+        pc = d->stack[--sp];
+        if(d->mark[pc] == d->markgen)
+            continue;
+        d->mark[pc] = d->markgen;
+        switch(inst[pc].op) {
+            case RE_EOL:
+                if(at & RE_AT_EOL) {
+                    d->stack[sp++] = pc + 1;
+                } else {
+                    d->set[d->nset++] = pc;
+                }
+                break;
+            case RE_SET:
+            case RE_MATCH:
+                d->set[d->nset++] = pc;
+                break;
+            case RE_JMP:
+                d->stack[sp++] = inst[pc].x;
+                break;
+            case RE_SPLIT:
+                d->stack[sp++] = inst[pc].y;
+                d->stack[sp++] = inst[pc].x;
+                break;
+            case RE_BOL:
+                if(at & RE_AT_BOL)
+                    d->stack[sp++] = pc + 1;
+                break;
+        }
+    }
+}
+
+int regexCompareInt(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+int regexStateFor(struct regexDfa *d) {
+    // Index of the state for the set just built, making it if it is new
+    qsort(d->set, d->nset, sizeof(int), regexCompareInt);
+    unsigned int h = 2166136261u;
+    for(int j = 0; j < d->nset; j++) {
+        h = (h ^ d->set[j]) * 16777619u;
+    }
+    unsigned int mask = KILO_REGEX_STATES * 2 - 1;
+    unsigned int slot = h & mask;
+    while(d->table[slot]) {
+        struct regexState *st = &d->states[d->table[slot] - 1];
+        if(st->npcs == d->nset && !memcmp(st->pcs, d->set, sizeof(int) * d->nset))
+            return d->table[slot] - 1;
+        slot = (slot + 1) & mask;
+    }
+    if(d->nstates == KILO_REGEX_STATES) {
+        regexDfaFlush(d);
+        slot = h & mask;
+    }
+    if(d->nstates == d->capstates) {
+        d->capstates = d->capstates ? d->capstates * 2 : 16;
+        d->states = realloc(d->states, sizeof(struct regexState) * d->capstates);
+    }
+    struct regexState *st = &d->states[d->nstates];
+    st->npcs = d->nset;
+    st->pcs = malloc(sizeof(int) * (d->nset ? d->nset : 1));
+    memcpy(st->pcs, d->set, sizeof(int) * d->nset);
+    memset(st->next, -1, sizeof(st->next));
+
+    // Does it match, now or at the end of a line?  The second means following any $ to a match
+    struct regexInst *inst = d->re->inst;
+    st->accept = 0;
+    for(int j = 0; j < d->nset; j++) {
+        if(inst[d->set[j]].op == RE_MATCH)
+            st->accept = 1;
+    }
+    d->markgen++;
+    d->nset = 0;
+    for(int j = 0; j < st->npcs; j++) {
+        if(inst[st->pcs[j]].op == RE_EOL)
+            regexAddClosure(d, st->pcs[j] + 1, RE_AT_EOL);
+    }
+    st->accept_eol = st->accept;
+    for(int j = 0; j < d->nset; j++) {
+        if(inst[d->set[j]].op == RE_MATCH)
+            st->accept_eol = 1;
+    }
+
+    while(d->table[slot])
+        slot = (slot + 1) & mask;
+    d->table[slot] = d->nstates + 1;
+    return d->nstates++;
+}
+
+int regexStart(struct regexDfa *d, int bol) {
+    // State at the start of a line (bol) or anywhere else
+    if(d->start[bol] < 0) {
+        d->markgen++;
+        d->nset = 0;
+        regexAddClosure(d, 0, bol ? RE_AT_BOL : 0);
+        int s = regexStateFor(d);
+        d->start[bol] = s;
+    }
+    return d->start[bol];
+}
+
+int regexEmptyMatch(struct regexDfa *d) {
+    // 1 if the pattern matches an empty line, where ^ and $ both hold
+    d->markgen++;
+    d->nset = 0;
+    regexAddClosure(d, 0, RE_AT_BOL | RE_AT_EOL);
+    for(int j = 0; j < d->nset; j++) {
+        if(d->re->inst[d->set[j]].op == RE_MATCH)
+            return 1;
+    }
+    return 0;
+}
+
+int regexStep(struct regexDfa *d, int s, int c) {
+    // State after state s reads byte c
+    int next = d->states[s].next[c];
+    if(next >= 0)
+        return next;
+    d->markgen++;
+    d->nset = 0;
+    struct regexState *st = &d->states[s];
+    for(int j = 0; j < st->npcs; j++) {
+        struct regexInst *inst = &d->re->inst[st->pcs[j]];
+        if(inst->op == RE_SET && regexSetHas(regexSetBits(d->re, inst->x), c))
+            regexAddClosure(d, st->pcs[j] + 1, 0);
+    }
+    // A match could also start at the next byte
+    if(!d->anchored)
+        regexAddClosure(d, 0, 0);
+    int flushes = d->flushes;
+    next = regexStateFor(d);
+    // Unless the states were just thrown away, remember the way
+    if(d->flushes == flushes)
+        d->states[s].next[c] = next;
+    return next;
+}
+
+void regexIdle(struct regexDfa *d) {
+    // Work out which bytes lead out of the unanchored "nothing yet" state.  If that fills the cache, there's
+    // no skipping ahead until the next try
+    if(d->idle >= 0 || d->anchored)
+        return;
+    int idle = regexStart(d, 0);
+    int flushes = d->flushes;
+    int out = -2;
+    for(int c = 0; c < 256 && d->flushes == flushes; c++) {
+        if(regexStep(d, idle, c) != idle)
+            out = (out == -2) ? c : -1;
+    }
+    if(d->flushes != flushes)
+        return;
+    d->idle = idle;
+    d->idle_byte = out;
+}
+
+int regexMatchLine(struct regexDfa *d, const char *a, int alen, const char *b, int blen) {
+    // 1 if the line made of a then b has a match in it, with an unanchored DFA.  While nothing has started
+    // matching, memchr skips to the one byte that could start a match, if there is only one
+    if(alen + blen == 0)
+        return regexEmptyMatch(d);
+    regexIdle(d);
+    int s = regexStart(d, 1);
+    for(int seg = 0; seg < 2 && !d->states[s].accept; seg++) {
+        const char *p = seg ? b : a;
+        const char *end = p + (seg ? blen : alen);
+        while(p < end) {
+            // d->idle is -1 again if the states were thrown away, until the next line
+            if(s == d->idle && d->idle_byte != -1) {
+                if(d->idle_byte == -2 || (p = memchr(p, d->idle_byte, end - p)) == NULL)
+                    break;
+            }
+            s = regexStep(d, s, (unsigned char)*p++);
+            if(d->states[s].accept)
+                return 1;
+        }
+    }
+    return d->states[s].accept || d->states[s].accept_eol;
+}
+
+int regexStarts(struct regexDfa *rev, const char *a, int alen, const char *b, int blen) {
+    // Mark every place in the line made of a then b that a match starts, for regexFind, and return how many
+    // there are.  rev is the unanchored DFA of the reversed pattern: run from the end of the line back to the
+    // start, it accepts at each place a match of the pattern could start.  One pass however many times
+    // regexFind is then called
+    int len = alen + blen;
+    if(len + 1 > rev->capstarts) {
+        rev->capstarts = len + 1 > rev->capstarts * 2 ? len + 1 : rev->capstarts * 2;
+        rev->starts = realloc(rev->starts, rev->capstarts);
+    }
+    // Starting at the end of the line is starting at the beginning of the reversed one, where $ holds
+    int s = regexStart(rev, 1);
+    rev->starts[len] = rev->states[s].accept;
+    for(int j = blen - 1; j >= 0; j--) {
+        s = regexStep(rev, s, (unsigned char)b[j]);
+        rev->starts[alen + j] = rev->states[s].accept;
+    }
+    for(int j = alen - 1; j >= 0; j--) {
+        s = regexStep(rev, s, (unsigned char)a[j]);
+        rev->starts[j] = rev->states[s].accept;
+    }
+    // And ^ holds at the end of the reversed line
+    if(rev->states[s].accept_eol)
+        rev->starts[0] = 1;
+    int n = 0;
+    for(int j = 0; j <= len; j++) {
+        n += rev->starts[j];
+    }
+    return n;
+}
+
+int regexFind(struct regexDfa *rev, struct regexDfa *anchored, const char *a, int alen, const char *b, int blen,
+    int from, int *mlen) {
+    // Leftmost, then longest, match in the line made of a then b starting at from or later: returns where it
+    // starts and sets *mlen, or returns -1.  regexStarts must have been run on the line with rev first.  The
+    // first place marked from on is where the match starts, then one pass of the anchored DFA finds its longest
+    // length
+    int len = alen + blen;
+    if(len == 0) {
+        *mlen = 0;
+        return regexEmptyMatch(anchored) ? 0 : -1;
+    }
+    for(int start = from; start <= len; start++) {
+        if(!rev->starts[start])
+            continue;
+        int best = -1;
+        int s = regexStart(anchored, start == 0);
+        if(anchored->states[s].accept)
+            best = start;
+        int j;
+        for(j = start; j < len; j++) {
+            s = regexStep(anchored, s, (unsigned char)((j < alen) ? a[j] : b[j - alen]));
+            if(anchored->states[s].npcs == 0)
+                break;
+            if(anchored->states[s].accept)
+                best = j + 1;
+        }
+        if(j == len && anchored->states[s].accept_eol)
+            best = len;
+        if(best >= 0) {
+            *mlen = best - start;
+            return start;
+        }
+    }
+    return -1;
+}
+
+/* Find */
+// Rows containing a query.  One is kept for each query typed so far in the prompt: typing another character only
+// has to look again at the rows that matched before, and backspace goes straight back to the previous list.
+// In regex mode dfa is set and rows match the pattern in query instead
+struct findLevel {
+    char *query;
+    int qlen;
+    int *rows;
+    int n;
+    int cap;
+    struct regexDfa *dfa;
+};
+
+struct findLevel findLevels[64];
+int findDepth = 0;
+
+// Regex mode: Ctrl-R instead of Ctrl-F.  A longer pattern can match rows a shorter one didn't, so there's no
+// narrowing, just one list for the current pattern along with its compiled form
+int findRegex = 0;
+struct findLevel regexLevel;
+struct regex *findRe = NULL;
+struct regexDfa *findAnchored = NULL;
+
+char *editorFindIn(const char *text, int len, const char *query, int qlen) {
+    // First occurrence of query in len bytes of text, or NULL.  memchr jumps to each candidate for the first
+    // byte a vector at a time, then the rest is compared
+    const char *end = text + len - qlen + 1;
+    while(text < end) {
+        text = memchr(text, query[0], end - text);
+        if(text == NULL)
+            return NULL;
+        if(!memcmp(text + 1, query + 1, qlen - 1))
+            return (char *)text;
+        text++;
+    }
+    return NULL;
+}
+
+int editorFindInRowFrom(erow *row, int from, const char *query, int qlen) {
+    // Index of query in row at from or after, or -1.  The text is searched either side of the gap, and across
+    // it, without moving the gap, so any number of threads can search rows at once
+    char *text = row->chars;
+    int before = row->gap;
+    int after = row->size - row->gap;
+    char *hit = NULL;
+    if(from < before)
+        hit = editorFindIn(&text[from], before - from, query, qlen);
+    if(hit)
+        return hit - text;
+    if(after == 0)
+        return -1;
+    char *rest = &text[row->gap + row->gaplen];
+    if(before > from && qlen > 1) {
+        // A match across the gap has at most qlen - 1 bytes on each side of it
+        int left = before - from < qlen - 1 ? before - from : qlen - 1;
+        int right = after < qlen - 1 ? after : qlen - 1;
+        char small[128];
+        char *join = (left + right <= (int)sizeof(small)) ? small : malloc(left + right);
+        memcpy(join, &text[before - left], left);
+        memcpy(&join[left], rest, right);
+        hit = editorFindIn(join, left + right, query, qlen);
+        int at = hit ? before - left + (hit - join) : -1;
+        if(join != small)
+            free(join);
+        if(at != -1)
+            return at;
+    }
+    int skip = (from > before) ? from - before : 0;
+    hit = editorFindIn(&rest[skip], after - skip, query, qlen);
+    return hit ? before + (hit - rest) : -1;
+}
+
+int editorFindInRow(erow *row, const char *query, int qlen) {
+    // Index of query in row, or -1
+    return editorFindInRowFrom(row, 0, query, qlen);
+}
+
+void editorFindAdd(struct findLevel *level, int at) {
+    if(level->n == level->cap) {
+        level->cap = level->cap ? level->cap * 2 : 256;
+        level->rows = realloc(level->rows, sizeof(int) * level->cap);
+    }
+    level->rows[level->n++] = at;
+}
+
+int editorFindRowMatches(struct findLevel *level, erow *row) {
+    if(level->dfa)
+        return regexMatchLine(level->dfa, row->chars, row->gap, &row->chars[row->gap + row->gaplen],
+            row->size - row->gap);
+    return editorFindInRow(row, level->query, level->qlen) != -1;
+}
+
+void editorFindRunRegex(struct findLevel *level, const char *start, const char *end, int first) {
+    // editorFindRun for a regex, which has to go a line at a time so ^ and $ mean something
+    // The run's last row ends at end, and can be empty
+    int at = first;
+    for(;;) {
+        const char *nl = memchr(start, '\n', end - start);
+        const char *stop = nl ? nl : end;
+        const char *eol = stop;
+        while(eol > start && eol[-1] == '\r')
+            eol--;
+        if(regexMatchLine(level->dfa, start, eol - start, NULL, 0))
+            editorFindAdd(level, at);
+        if(nl == NULL)
+            break;
+        start = nl + 1;
+        at++;
+    }
+}
+
+void editorFindRun(struct findLevel *level, const char *start, const char *end, int first) {
+    // Search unedited rows first onwards, which run from start to end in the map, as one piece of text.
+    // Line numbers come from counting newlines up to each hit, and the rest of a row is skipped once it matches
+    if(level->dfa) {
+        editorFindRunRegex(level, start, end, first);
+        return;
+    }
+    const char *counted = start;
+    int at = first;
+    const char *hit;
+    while((hit = editorFindIn(start, end - start, level->query, level->qlen)) != NULL) {
+        at += editorCountByte(counted, hit - counted, '\n');
+        editorFindAdd(level, at);
+        const char *nl = memchr(hit, '\n', end - hit);
+        if(nl == NULL)
+            break;
+        start = counted = nl + 1;
+        at++;
+    }
+}
+
+void editorFindScanLeaves(struct findLevel *level, struct rowNode **leaves, int nleaves, int at) {
+    // Find every row containing the query in nleaves leaves, the first of which starts at line at.
+    // Rows that still sit next to each other in the map (nothing but a line ending between them) are
+    // gathered into runs and searched in one go
+    const char *run = NULL;
+    const char *runend = NULL;
+    int runfirst = 0;
+    for(int l = 0; l < nleaves; l++) {
+        struct rowNode *leaf = leaves[l];
+        for(int j = 0; j < leaf->n; j++, at++) {
+            erow *row = &leaf->rows[j];
+            if(row->flags & ROW_MAPPED) {
+                if(run) {
+                    const char *p = runend;
+                    while(p < row->chars && *p == '\r')
+                        p++;
+                    if(*p == '\n' && p + 1 == row->chars) {
+                        runend = row->chars + row->size;
+                        continue;
+                    }
+                    editorFindRun(level, run, runend, runfirst);
+                }
+                run = row->chars;
+                runend = row->chars + row->size;
+                runfirst = at;
+                continue;
+            }
+            if(run) {
+                editorFindRun(level, run, runend, runfirst);
+                run = NULL;
+            }
+            if(editorFindRowMatches(level, row))
+                editorFindAdd(level, at);
+        }
+    }
+    if(run)
+        editorFindRun(level, run, runend, runfirst);
+}
+
+void editorFindNarrowRange(struct findLevel *level, struct findLevel *from, int first, int last) {
+    // Keep the rows from first up to last in from's list that also contain this level's longer query.
+    // The rows are in order, so while they are in the same leaf there is no need to look them up in the tree
+    struct rowNode *leaf = NULL;
+    int base = 0;
+    for(int i = first; i < last; i++) {
+        int at = from->rows[i];
+        if(leaf == NULL || at - base >= leaf->n) {
+            erow *row = editorRowAt(at);
+            leaf = row->leaf;
+            base = at - (row - leaf->rows);
+        }
+        if(editorFindInRow(&leaf->rows[at - base], level->query, level->qlen) != -1)
+            editorFindAdd(level, at);
+    }
+}
+
+// A search split into parts for the worker pool: each part covers a range of leaves (or of the previous
+// list) and fills its own list, and the lists are joined in order at the end
+struct findJob {
+    struct findLevel *level;
+    struct findLevel *from;
+    struct rowNode **leaves;
+    int *starts;
+    int nleaves;
+    struct findLevel *out;
+    int parts;
+};
+
+void editorFindPart(void *arg, int part) {
+    struct findJob *job = arg;
+    struct findLevel *out = &job->out[part];
+    if(job->from) {
+        editorFindNarrowRange(out, job->from, (long long)job->from->n * part / job->parts,
+            (long long)job->from->n * (part + 1) / job->parts);
+    } else {
+        int first = (long long)job->nleaves * part / job->parts;
+        int last = (long long)job->nleaves * (part + 1) / job->parts;
+        if(first < last)
+            editorFindScanLeaves(out, &job->leaves[first], last - first, job->starts[first]);
+    }
+}
+
+void editorFindSearch(struct findLevel *level, struct findLevel *from) {
+    // Fill level's list by narrowing from's, or by searching the whole file if from is NULL.
+    // Big searches are shared out between threads
+    struct findJob job;
+    int rows = from ? from->n : editorNumRows();
+    job.parts = (rows >= KILO_FIND_PARALLEL) ? U.findThreads * KILO_FIND_SPLIT : 1;
+    job.level = level;
+    job.from = from;
+    job.leaves = NULL;
+    job.starts = NULL;
+    job.nleaves = 0;
+    if(from == NULL) {
+        // Leaves in order with the line each starts at, so parts can start anywhere
+        int cap = 64;
+        job.leaves = malloc(sizeof(struct rowNode *) * cap);
+        job.starts = malloc(sizeof(int) * cap);
+        int at = 0;
+        erow *row = editorRowAt(0);
+        while(row) {
+            struct rowNode *leaf = row->leaf;
+            if(job.nleaves == cap) {
+                cap *= 2;
+                job.leaves = realloc(job.leaves, sizeof(struct rowNode *) * cap);
+                job.starts = realloc(job.starts, sizeof(int) * cap);
+            }
+            job.leaves[job.nleaves] = leaf;
+            job.starts[job.nleaves++] = at;
+            at += leaf->n;
+            row = editorRowNext(&leaf->rows[leaf->n - 1]);
+        }
+    }
+    job.out = calloc(job.parts, sizeof(struct findLevel));
+    for(int part = 0; part < job.parts; part++) {
+        job.out[part].query = level->query;
+        job.out[part].qlen = level->qlen;
+        // A DFA builds its states as it goes, so threads can't share one
+        if(level->dfa)
+            job.out[part].dfa = (job.parts > 1) ? regexDfaNew(level->dfa->re, 0) : level->dfa;
+    }
+
+    workerPoolRun(editorFindPart, &job, job.parts);
+
+    // Join the parts' lists
+    for(int part = 0; part < job.parts; part++) {
+        level->cap += job.out[part].n;
+    }
+    level->rows = malloc(sizeof(int) * (level->cap ? level->cap : 1));
+    for(int part = 0; part < job.parts; part++) {
+        if(job.out[part].n) {
+            memcpy(&level->rows[level->n], job.out[part].rows, sizeof(int) * job.out[part].n);
+            level->n += job.out[part].n;
+        }
+        free(job.out[part].rows);
+        if(job.out[part].dfa != level->dfa)
+            regexDfaFree(job.out[part].dfa);
+    }
+    free(job.out);
+    free(job.leaves);
+    free(job.starts);
+}
+
+void editorFindReset() {
+    // Forget the row lists when the search is over
+    while(findDepth > 0) {
+        findDepth--;
+        free(findLevels[findDepth].query);
+        free(findLevels[findDepth].rows);
+    }
+    if(findRe) {
+        free(regexLevel.rows);
+        regexDfaFree(regexLevel.dfa);
+        regexDfaFree(findAnchored);
+        regexFree(findRe);
+        findRe = NULL;
+    }
+}
+
+struct findLevel *editorFindRows(char *query) {
+    // Rows containing query, in order.  Lists for queries that aren't part of this one are dropped, and
+    // the newest one left is narrowed down, or the whole file searched if there is none
+    int qlen = strlen(query);
+    while(findDepth > 0 && !strstr(query, findLevels[findDepth - 1].query)) {
+        findDepth--;
+        free(findLevels[findDepth].query);
+        free(findLevels[findDepth].rows);
+    }
+    if(findDepth > 0 && findLevels[findDepth - 1].qlen == qlen)
+        return &findLevels[findDepth - 1];
+    // Out of room: start again from the whole file
+    if(findDepth == (int)(sizeof(findLevels) / sizeof(findLevels[0])))
+        editorFindReset();
+
+    struct findLevel *level = &findLevels[findDepth];
+    level->query = strdup(query);
+    level->qlen = qlen;
+    level->rows = NULL;
+    level->n = level->cap = 0;
+    editorFindSearch(level, findDepth > 0 ? &findLevels[findDepth - 1] : NULL);
+    findDepth++;
+    return level;
+}
+
+struct findLevel *editorRegexRows(char *pattern) {
+    // Rows with a match for pattern, in order, or NULL if it isn't a valid pattern
+    if(findRe && !strcmp(findRe->pattern, pattern))
+        return &regexLevel;
+    struct regex *re = regexCompile(pattern);
+    if(re == NULL)
+        return NULL;
+    editorFindReset();
+    findRe = re;
+    findAnchored = regexDfaNew(re, 1);
+    regexLevel.query = re->pattern;
+    regexLevel.qlen = strlen(pattern);
+    regexLevel.rows = NULL;
+    regexLevel.n = regexLevel.cap = 0;
+    regexLevel.dfa = regexDfaNew(re, 0);
+    editorFindSearch(&regexLevel, NULL);
+    return &regexLevel;
+}
+
+/* Match index */
+// Every match of the last search, in file order.  They are drawn over the syntax colours rather than written
+// into hl, and the list outlives the prompt: edits keep it up to date a row at a time until Esc clears it
+struct match {
+    int row;
+    int off;
+    int len;
+};
+
+struct matchIndex {
+    struct match *m;
+    int n;
+    int cap;
+    int active;
+    // What rows are searched for: query as it is, or compiled into re in regex mode
+    char *query;
+    int qlen;
+    struct regex *re;
+    // The reversed pattern's DFA marks where matches start in a row, the anchored one finds how long they are
+    struct regexDfa *reverse;
+    struct regexDfa *anchored;
+    // One row's matches while they are found
+    struct match *row;
+    int nrow;
+    int caprow;
+};
+
+struct matchIndex matches;
+
+void editorMatchAdd(struct match **list, int *n, int *cap, int row, int off, int len) {
+    if(*n == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        *list = realloc(*list, sizeof(struct match) * *cap);
+    }
+    (*list)[*n].row = row;
+    (*list)[*n].off = off;
+    (*list)[*n].len = len;
+    (*n)++;
+}
+
+void editorMatchScanRow(erow *row, int at, struct match **list, int *n, int *cap) {
+    // Add row's matches to list, left to right without overlapping.  Empty regex matches (^$, x*) aren't
+    // listed, unless there is nothing else in the row to show it matched.  The text either side of the gap is
+    // searched where it is, so the gap stays where it is being edited
+    if(matches.re == NULL) {
+        int off = 0;
+        while((off = editorFindInRowFrom(row, off, matches.query, matches.qlen)) != -1) {
+            editorMatchAdd(list, n, cap, at, off, matches.qlen);
+            off += matches.qlen;
+        }
+        return;
+    }
+    const char *a = row->chars;
+    const char *b = &row->chars[row->gap + row->gaplen];
+    int blen = row->size - row->gap;
+    int found = *n;
+    int empty = -1;
+    int from = 0;
+    if(row->size > 0 && regexStarts(matches.reverse, a, row->gap, b, blen) == 0)
+        return;
+    while(from <= row->size) {
+        int mlen;
+        int off = regexFind(matches.reverse, matches.anchored, a, row->gap, b, blen, from, &mlen);
+        if(off < 0)
+            break;
+        if(mlen > 0) {
+            editorMatchAdd(list, n, cap, at, off, mlen);
+        } else if(empty < 0) {
+            empty = off;
+        }
+        from = off + (mlen ? mlen : 1);
+    }
+    if(*n == found && empty >= 0)
+        editorMatchAdd(list, n, cap, at, empty, 0);
+}
+
+int editorMatchFirst(int row) {
+    // Index of the first match in row or after it
+    int lo = 0;
+    int hi = matches.n;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(matches.m[mid].row < row) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void editorMatchClear() {
+    free(matches.m);
+    free(matches.query);
+    free(matches.row);
+    regexDfaFree(matches.reverse);
+    regexDfaFree(matches.anchored);
+    regexFree(matches.re);
+    memset(&matches, 0, sizeof(matches));
+}
+
+void editorMatchBuild(struct findLevel *level, char *query, int regex) {
+    // List the matches in the rows of level, found for query.  Nothing to do if that's already been done
+    if(matches.active && (matches.re != NULL) == regex && !strcmp(matches.query, query))
+        return;
+    editorMatchClear();
+    matches.active = 1;
+    matches.query = strdup(query);
+    matches.qlen = strlen(query);
+    if(regex) {
+        matches.re = regexCompile(query);
+        matches.reverse = regexDfaNew(matches.re->reverse, 0);
+        matches.anchored = regexDfaNew(matches.re, 1);
+    }
+    // The rows are in order, so while they are in the same leaf there is no need to look them up in the tree
+    struct rowNode *leaf = NULL;
+    int base = 0;
+    for(int i = 0; i < level->n; i++) {
+        int at = level->rows[i];
+        if(leaf == NULL || at - base >= leaf->n) {
+            erow *row = editorRowAt(at);
+            leaf = row->leaf;
+            base = at - (row - leaf->rows);
+        }
+        editorMatchScanRow(&leaf->rows[at - base], at, &matches.m, &matches.n, &matches.cap);
+    }
+}
+
+void editorMatchReplace(int lo, int hi, int at, int count) {
+    // Swap the entries from lo up to hi for a fresh look at count rows from at
+    matches.nrow = 0;
+    erow *row = editorRowAt(at);
+    for(int j = 0; j < count; j++, row = editorRowNext(row)) {
+        editorMatchScanRow(row, at + j, &matches.row, &matches.nrow, &matches.caprow);
+    }
+    int n = matches.n - (hi - lo) + matches.nrow;
+    if(n > matches.cap) {
+        matches.cap = (n > matches.cap * 2) ? n : matches.cap * 2;
+        matches.m = realloc(matches.m, sizeof(struct match) * matches.cap);
+    }
+    if(matches.n > hi)
+        memmove(&matches.m[lo + matches.nrow], &matches.m[hi], sizeof(struct match) * (matches.n - hi));
+    if(matches.nrow)
+        memcpy(&matches.m[lo], matches.row, sizeof(struct match) * matches.nrow);
+    matches.n = n;
+}
+
+void editorMatchRowChanged(int at) {
+    if(!matches.active)
+        return;
+    editorMatchReplace(editorMatchFirst(at), editorMatchFirst(at + 1), at, 1);
+}
+
+void editorMatchRowsInserted(int at, int count) {
+    // Rows from at down move count further down the file, below count new rows
+    if(!matches.active)
+        return;
+    int lo = editorMatchFirst(at);
+    for(int i = lo; i < matches.n; i++) {
+        matches.m[i].row += count;
+    }
+    editorMatchReplace(lo, lo, at, count);
+}
+
+void editorMatchRowsDeleted(int at, int count) {
+    if(!matches.active)
+        return;
+    int lo = editorMatchFirst(at);
+    int hi = editorMatchFirst(at + count);
+    if(matches.n > hi)
+        memmove(&matches.m[lo], &matches.m[hi], sizeof(struct match) * (matches.n - hi));
+    matches.n -= hi - lo;
+    for(int i = lo; i < matches.n; i++) {
+        matches.m[i].row -= count;
+    }
+}
+
+int editorMatchAt(int row, int off) {
+    // Index of the match starting at off in row, or -1
+    for(int i = editorMatchFirst(row); i < matches.n && matches.m[i].row == row; i++) {
+        if(matches.m[i].off == off)
+            return i;
+    }
+    return -1;
+}
+
+void editorFindCallback(char *query, int key) {
+    // Index of the match the cursor was moved to, -1 if none
+    // Only set this to anything other than -1 when an arrow key is pressed
+    static int last_match = -1;
+
+    // 1: search forward, -1: search backward
+    static int direction = 1;
+
+    // Stop if user presses enter or escape
+    if(key == '\r' || key == '\x1b') {
+        // Leave search mode, reset values to initial.  Enter leaves the matches showing
+        last_match = -1;
+        direction = 1;
+        editorFindReset();
+        if(key == '\x1b')
+            editorMatchClear();
+        return;
+    } else if(key == ARROW_RIGHT || key == ARROW_DOWN) {
+        // Search forwards
+        direction = 1;
+    } else if(key == ARROW_LEFT || key == ARROW_UP) {
+        // Search backwards
+        direction = -1;
+    } else {
+        last_match = -1;
+        direction = 1;
+    }
+
+    // You can only search forward if there are no results
+    if(last_match == -1)
+        direction = 1;
+
+    // Find the rows with matches, then list the matches in them
+    struct findLevel *level = NULL;
+    if(query[0] != '\0')
+        level = findRegex ? editorRegexRows(query) : editorFindRows(query);
+    if(level == NULL || level->n == 0) {
+        editorMatchClear();
+        return;
+    }
+    editorMatchBuild(level, query, findRegex);
+
+    // Pick the match after (or before) the last one, wrapping around the file
+    if(last_match == -1) {
+        last_match = 0;
+    } else {
+        last_match = (last_match + direction + matches.n) % matches.n;
+    }
+    struct match *m = &matches.m[last_match];
+    E.cy = m->row;
+    // Move cursor to the start of the result
+    E.cx = m->off;
+    // Scroll result to the top next screen refresh
+    E.rowoff = editorNumRows();
 }
 
-void editorFind() {
+void editorFind(int regex) {
     // Save data to return cursor to original position
     int saved_cx = E.cx;
     int saved_cy = E.cy;
@@ -1052,8 +6105,10 @@ void editorFind() {
     int saved_rowoff = E.rowoff;
 
     // Get query
-    char *query = editorPrompt("Search: %s (ESC/Arrow keys/Enter)", editorFindCallback);
-    
+    findRegex = regex;
+    char *query = editorPrompt(regex ? "Regex: %s (ESC/Arrow keys/Enter)" : "Search: %s (ESC/Arrow keys/Enter)",
+        editorFindCallback);
+
     // Free memory
     if(query) {
         free(query);
@@ -1066,31 +6121,61 @@ void editorFind() {
     }
 }
 
+void editorGotoLine() {
+    // Move the cursor to the start of a line number typed by the user
+    char *query = editorPrompt((view.on || store.on) ? "Go to line: %s ($ for the end, ESC to cancel)" : "Go to line: %s (ESC to cancel)", NULL);
+    if(query == NULL)
+        return;
+    if(view.on || store.on) {
+        if(view.on)
+            editorViewGoto(query);
+        else
+            editorChunkGoto(query);
+        free(query);
+        return;
+    }
+    int line = atoi(query);
+    free(query);
+
+    // Clamp to the file
+    if(line > editorNumRows())
+        line = editorNumRows();
+    if(line < 1)
+        line = 1;
+    E.cy = line - 1;
+    E.cx = 0;
+}
+
 
 /* Append buffer */
 
-// Pointer to buffer start and length
+// Pointer to buffer start, length and bytes allocated
 struct abuf {
     char *b;
     int len;
+    int cap;
 };
 
 // Define empty buffer
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 
 void abAppend(struct abuf *ab, const char *s, int len) {
-    // Append a character to the buffer
-
-    // Get block of memory that is size of current string plus length of string to append
-    char *new = realloc(ab->b, ab->len + len);
-
-    if(new == NULL)
-        return;
+    // Append a string to the buffer
+
+    // Grow geometrically, so a buffer that is reused soon stops allocating at all
+    if(ab->len + len > ab->cap) {
+        int cap = ab->cap * 2;
+        if(cap < ab->len + len)
+            cap = ab->len + len;
+        char *new = realloc(ab->b, cap);
+        if(new == NULL)
+            return;
+        ab->b = new;
+        ab->cap = cap;
+    }
     // Copy s to the end of the buffer and update length
-    memcpy(&new[ab->len], s, len);
-    // Update pointer to start of buffer
-    ab->b = new;
-    ab-> len += len;
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
 }
 
 void abFree(struct abuf *ab) {
@@ -1099,12 +6184,159 @@ void abFree(struct abuf *ab) {
 }
 
 
+/* Latency */
+// Each stage of handling a key and drawing the frame after it is timed on the monotonic clock, and the times
+// kept in a histogram per stage: buckets 1/8 of a power of two wide, so percentiles are within 12.5%.  "key"
+// runs from the input turning up to the frame that shows it being written.  Ctrl-T shows the stages one at a
+// time in the message bar, and with latencylog set in the config they are appended to that file at exit
+enum latencyStage {
+    LAT_KEY = 0,
+    LAT_INPUT,
+    LAT_EDIT,
+    LAT_SYNTAX,
+    LAT_DRAW,
+    LAT_DIFF,
+    LAT_WRITE,
+    LAT_STAGES
+};
+
+const char *latencyNames[LAT_STAGES] = {"key", "input", "edit", "syntax", "draw", "diff", "write"};
+
+struct latencyHistogram {
+    long long count;
+    long long sum;
+    long long max;
+    int buckets[KILO_LAT_BUCKETS];
+};
+
+struct latencyLog {
+    struct latencyHistogram stages[LAT_STAGES];
+    // When input was first seen since the last frame, and when the key now being read was, 0 if none
+    long long arrived;
+    long long ready;
+    // Times the editor has waited for a key, so a stage that includes one (a prompt) isn't counted
+    int waits;
+    // Stage shown next by Ctrl-T
+    int shown;
+};
+
+struct latencyLog latency;
+
+long long latencyNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int latencyBucket(long long ns) {
+    // Values under 8 have a bucket each, then 8 buckets to every power of two
+    if(ns < 8)
+        return (ns < 0) ? 0 : ns;
+    int e = 63 - __builtin_clzll(ns);
+    int idx = (e - 2) * 8 + ((ns >> (e - 3)) & 7);
+    return (idx < KILO_LAT_BUCKETS) ? idx : KILO_LAT_BUCKETS - 1;
+}
+
+long long latencyBucketMid(int idx) {
+    // The middle of the values that go in bucket idx
+    if(idx < 8)
+        return idx;
+    int e = idx / 8 + 2;
+    long long lo = (long long)(8 + idx % 8) << (e - 3);
+    return lo + ((1LL << (e - 3)) >> 1);
+}
+
+void latencyRecord(int stage, long long ns) {
+    struct latencyHistogram *h = &latency.stages[stage];
+    h->count++;
+    h->sum += ns;
+    if(ns > h->max)
+        h->max = ns;
+    h->buckets[latencyBucket(ns)]++;
+}
+
+void latencyInput() {
+    // Input is waiting: the first since the last frame starts the clock for "key"
+    long long now = latencyNow();
+    if(latency.arrived == 0)
+        latency.arrived = now;
+    latency.ready = now;
+}
+
+long long latencyPercentile(struct latencyHistogram *h, int percent) {
+    // Value below which percent of the samples fall, as near as the buckets tell
+    long long want = (h->count * percent + 99) / 100;
+    long long seen = 0;
+    for(int j = 0; j < KILO_LAT_BUCKETS; j++) {
+        seen += h->buckets[j];
+        if(seen >= want) {
+            long long mid = latencyBucketMid(j);
+            return (mid < h->max) ? mid : h->max;
+        }
+    }
+    return h->max;
+}
+
+char *latencyFormat(char *buf, size_t size, long long ns) {
+    // Print a duration in the most readable unit, into buf of size bytes
+    if(ns < 10000) {
+        snprintf(buf, size, "%lldns", ns);
+    } else if(ns < 10000000) {
+        snprintf(buf, size, "%lldus", ns / 1000);
+    } else {
+        snprintf(buf, size, "%lldms", ns / 1000000);
+    }
+    return buf;
+}
+
+void latencyShow() {
+    // Ctrl-T: the next stage's numbers in the message bar
+    int stage = latency.shown;
+    latency.shown = (stage + 1) % LAT_STAGES;
+    struct latencyHistogram *h = &latency.stages[stage];
+    if(h->count == 0) {
+        editorSetStatusMessage("latency %s: no samples yet", latencyNames[stage]);
+        return;
+    }
+    char p50[16], p99[16], max[16];
+    editorSetStatusMessage("latency %s: p50 %s p99 %s max %s (%lld)", latencyNames[stage],
+        latencyFormat(p50, sizeof(p50), latencyPercentile(h, 50)),
+        latencyFormat(p99, sizeof(p99), latencyPercentile(h, 99)), latencyFormat(max, sizeof(max), h->max), h->count);
+}
+
+void latencyWrite(FILE *fp) {
+    // A table of every stage, in microseconds
+    fprintf(fp, "%-8s %10s %10s %10s %10s %10s\n", "stage", "count", "mean_us", "p50_us", "p99_us", "max_us");
+    for(int i = 0; i < LAT_STAGES; i++) {
+        struct latencyHistogram *h = &latency.stages[i];
+        fprintf(fp, "%-8s %10lld %10.1f %10.1f %10.1f %10.1f\n", latencyNames[i], h->count,
+            h->count ? h->sum / 1000.0 / h->count : 0.0, latencyPercentile(h, 50) / 1000.0,
+            latencyPercentile(h, 99) / 1000.0, h->max / 1000.0);
+    }
+}
+
+void latencyDump() {
+    // At exit: add this session's numbers to the end of the latencylog file, under a line saying which version
+    // of kilo and what file they came from
+    if(U.latencyLog == NULL || latency.stages[LAT_KEY].count == 0)
+        return;
+    FILE *fp = fopen(U.latencyLog, "a");
+    if(fp == NULL)
+        return;
+    char date[32];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+    fprintf(fp, "# kilo %s %s %s\n", KILO_VERSION, date, E.filename ? E.filename : "[No Name]");
+    latencyWrite(fp);
+    fclose(fp);
+}
+
 /* Output */
 void editorScroll() {
     // Use render cursor values
     E.rx = 0;
-    if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    if (E.cy < editorNumRows()) {
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
     }
     // Is cursor above visible window
     if(E.cy < E.rowoff) {
@@ -1122,140 +6354,182 @@ void editorScroll() {
     if(E.rx >= E.coloff + E.screencols) {
         E.coloff = E.rx - E.screencols + 1;
     }
+    // Windowed files: load more rows around the screen if it has got near the edge of the window
+    if(view.on)
+        editorViewSlide();
+    if(store.on)
+        editorChunkSlide();
+}
+
+void editorFrameResize() {
+    // Make the frame match the screen size.  A new shadow is all unknown, so the next flush redraws everything
+    int rows = E.screenrows + 2;
+    int cols = E.screencols;
+    if(E.frame && rows == E.frame_rows && cols == E.frame_cols)
+        return;
+    E.frame_rows = rows;
+    E.frame_cols = cols;
+    E.frame = realloc(E.frame, rows * cols);
+    E.frame_attr = realloc(E.frame_attr, rows * cols);
+    E.shadow = realloc(E.shadow, rows * cols);
+    E.shadow_attr = realloc(E.shadow_attr, rows * cols);
+    editorFrameInvalidate();
+}
+
+void editorFrameInvalidate() {
+    // Forget what is on the terminal, for when something else has written to it
+    if(E.shadow_attr)
+        memset(E.shadow_attr, ATTR_UNKNOWN, E.frame_rows * E.frame_cols);
+    E.shadow_cy = E.shadow_cx = -1;
 }
 
-void editorDrawRows(struct abuf *ab) {
+char *editorFrameLine(int y, unsigned char **attr) {
+    // Blank screen line y of the frame and return its cells
+    char *line = &E.frame[y * E.frame_cols];
+    *attr = &E.frame_attr[y * E.frame_cols];
+    memset(line, ' ', E.frame_cols);
+    memset(*attr, 0, E.frame_cols);
+    return line;
+}
+
+void editorDrawRows() {
+    // Render and highlight only the rows that are on screen
+    long long start = latencyNow();
+    editorSyncSyntax(E.rowoff, E.rowoff + E.screenrows);
+    latencyRecord(LAT_SYNTAX, latencyNow() - start);
+
+    // Search matches from the first row on screen down, coloured over the syntax highlighting
+    int match = matches.active ? editorMatchFirst(E.rowoff) : 0;
+
     // Draw column of tildes on left side of screen
     int y;
     for(y = 0; y < E.screenrows; y++){
+        unsigned char *attr;
+        char *line = editorFrameLine(y, &attr);
         // If text doesn't fit on one screen
         int filerow = y + E.rowoff;
-        if(filerow >= E.numrows) {
+        if(filerow >= editorNumRows()) {
             //Draw empty row with a tilde at the start
 
             // Display welcome message 1/3 way down when an empty file is opened
-            if(E.numrows == 0 && y == E.screenrows / 3) {
+            if(editorNumRows() == 0 && y == E.screenrows / 3) {
                 char welcome[80];
                 int welcomelen = snprintf(welcome, sizeof(welcome),
                 "Kilo editor -- version %s", KILO_VERSION);
                 // Truncate message
                 if(welcomelen > E.screencols)
                     welcomelen = E.screencols;
-                    // Pad message to centre of screen
+                // Centre message, with the tilde still in the first column
                 int padding = (E.screencols - welcomelen) / 2;
-                if(padding) {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while(padding--)
-                    abAppend(ab, " ", 1);
-
-                abAppend(ab, welcome, welcomelen);
-            } else {
-                abAppend(ab, "~", 1);
+                if(padding)
+                    line[0] = '~';
+                memcpy(&line[padding], welcome, welcomelen);
+            } else if(E.screencols > 0) {
+                line[0] = '~';
             }
         } else {
             // Draw row with text in it
             // Subtract column offset for horizontal scrolling
-            int len = E.row[filerow].rsize - E.coloff;
+            erow *row = editorRowAt(filerow);
+            int len = row->rsize - E.coloff;
             // User scrolled past 0
             if(len < 0)
                 len = 0;
             if(len > E.screencols)
                 len = E.screencols;
             
-            char *c = &E.row[filerow].render[E.coloff];
+            char *c = &row->render[E.coloff];
             // Get pointer to correct part of hl array
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            // Keep track of current colour: -1 is default
-            int current_colour = -1;
+            unsigned char *hl = &row->hl[E.coloff];
             int j;
             for(j = 0; j < len; j++) {
+                // Colour of the character, 0 for default
+                attr[j] = (hl[j] == HL_NORMAL) ? 0 : editorSyntaxToColour(hl[j]);
                 // If there is a control character
                 if(iscntrl(c[j])) {
-                    // Make printable
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    // Invert colours, print, revert colours
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    // Deal with colours after reverting formatting
-                    if(current_colour != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_colour);
-                        abAppend(ab, buf, clen);
-                    }
-                } else if(hl[j] == HL_NORMAL) {
-                    // Character is normal colour
-                    if(current_colour != -1) {
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_colour = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
+                    // Make printable, in inverted colours
+                    line[j] = (c[j] <= 26) ? '@' + c[j] : '?';
+                    attr[j] |= ATTR_REVERSE;
                 } else {
-                    // Get colour
-                    int colour = editorSyntaxToColour(hl[j]);
-                    // Only print escape sequence if colour actually changes
-                    if(colour != current_colour) {
-                        current_colour = colour;
-                        // Write to buffer, inserting the correct colour code
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", colour);
-                        // Write colour buffer and character
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
+                    line[j] = c[j];
+                }
+            }
+            for(; match < matches.n && matches.m[match].row == filerow; match++) {
+                struct match *m = &matches.m[match];
+                int from = editorRowCxToRx(row, m->off) - E.coloff;
+                int to = editorRowCxToRx(row, m->off + m->len) - E.coloff;
+                for(j = (from > 0) ? from : 0; j < to && j < len; j++) {
+                    attr[j] = (attr[j] & ATTR_REVERSE) | editorSyntaxToColour(HL_MATCH);
                 }
             }
-            abAppend(ab, "\x1b[39m", 5);
         }
-
-        // Clear the row (K - erase in line - erase part of the line.  0 default - erase right from cursor)
-        abAppend(ab, "\x1b[K", 3);
-
-        // Don't print \r\n on last line
-        abAppend(ab, "\r\n", 2);
     }
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-    // Invert colours
-    abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar() {
+    // Inverted colours across the whole line
+    unsigned char *attr;
+    char *line = editorFrameLine(E.screenrows, &attr);
+    memset(attr, ATTR_REVERSE, E.screencols);
 
     // Status and row status buffer
     char status[80], rstatus[80];
     // Get length of status containing filename and number of lines, file name and if it has been edited
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-        E.filename ? E.filename : "[No Name]", E.numrows,
+        E.filename ? E.filename : "[No Name]", editorNumRows(),
         E.dirty ? "(modified)" : "");
-    // Get current line number
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+    // Get current line number, after the search matches if there are any: which one the cursor is on, or how many
+    char count[40] = "";
+    if(matches.active) {
+        int at = editorMatchAt(E.cy, E.cx);
+        if(at >= 0) {
+            snprintf(count, sizeof(count), "match %d of %d | ", at + 1, matches.n);
+        } else {
+            snprintf(count, sizeof(count), "%d match%s | ", matches.n, matches.n == 1 ? "" : "es");
+        }
+    }
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | %d/%d", count, E.syntax ? E.syntax->filetype : "no ft",
+        E.cy + 1, editorNumRows());
+    // Viewing: lines of the whole file, as far as they have been counted
+    if(view.on) {
+        len = snprintf(status, sizeof(status), "%.20s - %lld%s lines (read only)", E.filename, view.total,
+            view.indexed ? "" : "+");
+        if(!view.indexed)
+            len += snprintf(status + len, sizeof(status) - len, " indexing %d%%", view.percent);
+        char line[24] = "?";
+        if(view.line >= 0)
+            snprintf(line, sizeof(line), "%lld", view.line + E.cy + 1);
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | %s/%lld", E.syntax ? E.syntax->filetype : "no ft",
+            line, view.total);
+    }
+    // Chunked: lines of the whole file once every chunk is counted
+    if(store.on) {
+        long long total = editorChunkLinesBefore(store.n);
+        long long top = editorChunkLinesBefore(store.slots[0].chunk);
+        char lines[24] = "?";
+        char line[24] = "?";
+        if(total >= 0)
+            snprintf(lines, sizeof(lines), "%lld", total);
+        if(top >= 0)
+            snprintf(line, sizeof(line), "%lld", top + E.cy + 1);
+        len = snprintf(status, sizeof(status), "%.20s - %s lines %s", E.filename, lines,
+            E.dirty ? "(modified)" : "");
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | %s/%s", E.syntax ? E.syntax->filetype : "no ft",
+            line, lines);
+    }
     // Trim length if it goes over the number of columns on the screen
     if(len > E.screencols) {
         len = E.screencols;
     }
-    // Add to output buffer
-    abAppend(ab, status, len);
-    // Generate remaining whitespace on buffer
-    while(len < E.screencols) {
-        // Right align rstatus by continuing to print spaces until we reach the correct point on the line
-        if(E.screencols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
-            break;
-        } else {
-            abAppend(ab, " ", 1);
-            len++;
-        }
-    }
-    // Return to normal text formatting
-    abAppend(ab, "\x1b[m", 3);
-    // Draw empty newline
-    abAppend(ab, "\r\n", 2);
+    memcpy(line, status, len);
+    // Right align rstatus, if there is room for it after status
+    if(E.screencols - len >= rlen)
+        memcpy(&line[E.screencols - rlen], rstatus, rlen);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-    // Clear message bar
-    abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
+    unsigned char *attr;
+    char *line = editorFrameLine(E.screenrows + 1, &attr);
     // Make sure message will fit the width of screen
     int msglen = strlen(E.statusmsg);
     if(msglen > E.screencols) {
@@ -1263,41 +6537,169 @@ void editorDrawMessageBar(struct abuf *ab) {
     }
     // Display if the message is less than 5 seconds old
     if(msglen && (time(NULL) - E.statusmsg_time < 5)) {
-        abAppend(ab, E.statusmsg, msglen);
+        memcpy(line, E.statusmsg, msglen);
+    }
+}
+
+// Escape sequence switching the terminal to each cell attribute value, built once by editorInitSgr
+struct sgrEntry {
+    char seq[12];
+    int len;
+};
+
+struct sgrEntry sgrTable[256];
+
+void editorInitSgr() {
+    // Every sequence starts from a reset so nothing carries over from the attributes before
+    for(int attr = 0; attr < 256; attr++) {
+        char *buf = sgrTable[attr].seq;
+        int size = sizeof(sgrTable[attr].seq);
+        int len = snprintf(buf, size, "\x1b[0");
+        if(attr & ~ATTR_REVERSE)
+            len += snprintf(&buf[len], size - len, ";%d", attr & ~ATTR_REVERSE);
+        if(attr & ATTR_REVERSE)
+            len += snprintf(&buf[len], size - len, ";7");
+        buf[len++] = 'm';
+        sgrTable[attr].len = len;
+    }
+}
+
+void editorFlushFrame(struct abuf *ab) {
+    // Write only the parts of the frame that differ from the shadow, then make the shadow match.
+    // Each changed line is redrawn from its first to its last changed cell
+    int cols = E.frame_cols;
+    // Attributes the terminal is using, unknown until set
+    int current = -1;
+    int y;
+    for(y = 0; y < E.frame_rows; y++) {
+        char *line = &E.frame[y * cols];
+        unsigned char *attr = &E.frame_attr[y * cols];
+        char *old = &E.shadow[y * cols];
+        unsigned char *oldattr = &E.shadow_attr[y * cols];
+
+        int first = 0;
+        while(first < cols && line[first] == old[first] && attr[first] == oldattr[first])
+            first++;
+        // Line unchanged
+        if(first == cols)
+            continue;
+        int last = cols - 1;
+        while(last > first && line[last] == old[last] && attr[last] == oldattr[last])
+            last--;
+        // Multibyte characters don't take one column per byte, so the columns of a span can't be
+        // trusted on lines with any: redraw those lines whole
+        int j;
+        for(j = 0; j < cols; j++) {
+            if((unsigned char)line[j] >= 0x80 || (unsigned char)old[j] >= 0x80) {
+                first = 0;
+                last = cols - 1;
+                break;
+            }
+        }
+        // Where the rest of the line is blank, erase it instead of writing spaces
+        int blank = cols;
+        while(blank > 0 && line[blank - 1] == ' ' && attr[blank - 1] == 0)
+            blank--;
+        int end = last + 1;
+        int erase = 0;
+        if(end > blank) {
+            end = (blank > first) ? blank : first;
+            erase = 1;
+        }
+
+        // Move to the start of the span and write it
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, first + 1);
+        abAppend(ab, buf, len);
+        // Copy runs of cells with the same attributes in one go
+        j = first;
+        while(j < end) {
+            int run = j + 1;
+            while(run < end && attr[run] == attr[j])
+                run++;
+            if(attr[j] != current) {
+                abAppend(ab, sgrTable[attr[j]].seq, sgrTable[attr[j]].len);
+                current = attr[j];
+            }
+            abAppend(ab, &line[j], run - j);
+            j = run;
+        }
+        if(erase) {
+            // K - erase in line, from the cursor right.  Blank cells have default attributes
+            if(current != 0) {
+                abAppend(ab, "\x1b[m", 3);
+                current = 0;
+            }
+            abAppend(ab, "\x1b[K", 3);
+        }
+        memcpy(old, line, cols);
+        memcpy(oldattr, attr, cols);
     }
+    if(current > 0)
+        abAppend(ab, "\x1b[m", 3);
 }
 
 void editorRefreshScreen() {
     // Write bytes to terminal.
     // \x1b (27) escape character
     // [ follows in escape characters
+    struct allocSpan span;
+    allocBegin(&span);
     editorScroll();
-
-    // Init append buffer
-    struct abuf ab = ABUF_INIT;
+    editorFrameResize();
+
+    // Draw the whole frame, then write out only what changed since last time.  Drawing is timed without the
+    // highlighting editorDrawRows does first
+    long long start = latencyNow();
+    long long syntax = latency.stages[LAT_SYNTAX].sum;
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+    long long drawn = latencyNow();
+    latencyRecord(LAT_DRAW, drawn - start - (latency.stages[LAT_SYNTAX].sum - syntax));
+
+    // Output buffer, kept between frames so its memory is reused
+    static struct abuf ab = ABUF_INIT;
+    ab.len = 0;
 
     //Hide cursor while drawing (25l - cursor off)
     abAppend(&ab, "\x1b[?25l", 6);
-    // Reposition cursor (H) to top left corner
-    abAppend(&ab, "\x1b[H", 3);
-    // Draw row of text
-    editorDrawRows(&ab);
-    // Draw status bar
-    editorDrawStatusBar(&ab);
-    // Draw message bar
-    editorDrawMessageBar(&ab);
+    int hidden = ab.len;
+    editorFlushFrame(&ab);
+    long long diffed = latencyNow();
+    latencyRecord(LAT_DIFF, diffed - drawn);
+    int cy = E.cy - E.rowoff;
+    int cx = E.rx - E.coloff;
+    // Nothing changed and the cursor hasn't moved: skip the frame entirely
+    E.frame_bytes = 0;
+    if(ab.len == hidden && cy == E.shadow_cy && cx == E.shadow_cx) {
+        if(latency.arrived) {
+            latencyRecord(LAT_KEY, diffed - latency.arrived);
+            latency.arrived = 0;
+        }
+        allocEnd(&span, ALLOC_FRAME);
+        return;
+    }
     // Move cursor to current location
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy + 1, cx + 1);
     abAppend(&ab, buf, strlen(buf));
+    E.shadow_cy = cy;
+    E.shadow_cx = cx;
     // Show cursor again
     abAppend(&ab, "\x1b[?25h", 6);
 
     // Write buffer to output
-    write(STDOUT_FILENO, ab.b, ab.len);
-
-    // Free memory
-    abFree(&ab);
+    E.frame_bytes = ab.len;
+    if(E.outfd != -1)
+        write(E.outfd, ab.b, ab.len);
+    long long written = latencyNow();
+    latencyRecord(LAT_WRITE, written - diffed);
+    if(latency.arrived) {
+        latencyRecord(LAT_KEY, written - latency.arrived);
+        latency.arrived = 0;
+    }
+    allocEnd(&span, ALLOC_FRAME);
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -1317,7 +6719,293 @@ void editorSetStatusMessage(const char *fmt, ...) {
 
 }
 
+/* Record and replay */
+// kilo --record FILE saves everything read from the terminal, as it was read, with the time since the start
+// and the window size.  kilo --replay FILE feeds it back in place of the terminal with nothing drawn to the
+// screen, as fast as it goes or with --realtime at the recorded pace, then reports how long it took and the
+// latency of each stage.  The input is split the same way as it was read, and a read in the middle of a key
+// sees the same gaps, so escape sequences and pastes come out the same.  Saves are real: replay on a copy
+struct recordHeader {
+    char magic[8];
+    int rows;
+    int cols;
+};
+
+struct recordEntry {
+    // Nanoseconds since the recording started, and the window size then
+    long long ns;
+    int len;
+    short rows;
+    short cols;
+};
+
+struct recording {
+    FILE *fp;
+    char *path;
+    int replay;
+    int realtime;
+    // latencyNow() at the start
+    long long start;
+    // Replaying: the next entry, once read, and the recorded time reached so far
+    struct recordEntry next;
+    int loaded;
+    long long clock;
+    long long chunks;
+    long long bytes;
+};
+
+struct recording recording = {NULL, NULL, 0, 0, 0, {0, 0, 0, 0}, 0, 0, 0, 0};
+
+void editorRecordStart(char *path) {
+    recording.fp = fopen(path, "w");
+    if(recording.fp == NULL)
+        die("fopen");
+    struct recordHeader head = {"KILOREC1", E.screenrows + 2, E.screencols};
+    fwrite(&head, sizeof(head), 1, recording.fp);
+    fflush(recording.fp);
+    recording.start = latencyNow();
+}
+
+void editorRecordInput(const char *buf, int len) {
+    // Add what one read returned.  Flushed each time, so a session that ends in a crash is still there to replay
+    if(recording.fp == NULL || recording.replay)
+        return;
+    struct recordEntry entry = {latencyNow() - recording.start, len, E.screenrows + 2, E.screencols};
+    fwrite(&entry, sizeof(entry), 1, recording.fp);
+    fwrite(buf, 1, len, recording.fp);
+    fflush(recording.fp);
+}
+
+void editorReplayReport() {
+    double ms = (latencyNow() - recording.start) / 1e6;
+    printf("replay of %s: %lld reads, %lld bytes in %.1f ms (%s)\n", recording.path, recording.chunks,
+        recording.bytes, ms, recording.realtime ? "real time" : "as fast as possible");
+    printf("%lld keys, %lld frames\n", latency.stages[LAT_INPUT].count, latency.stages[LAT_DIFF].count);
+    latencyWrite(stdout);
+}
+
+void editorReplayStart(char *path, int realtime) {
+    // Set up to run without a terminal, sized as the recording was
+    struct recordHeader head;
+    recording.fp = fopen(path, "r");
+    if(recording.fp == NULL || fread(&head, sizeof(head), 1, recording.fp) != 1 || memcmp(head.magic, "KILOREC1", 8)) {
+        fprintf(stderr, "%s: not a kilo recording\n", path);
+        exit(1);
+    }
+    recording.path = path;
+    recording.replay = 1;
+    recording.realtime = realtime;
+    editorInitCore(head.rows, head.cols);
+    configOpen("bin/.kilorc");
+    quit_times = U.quitTimes;
+    // Nothing from the replay goes near the journal of the real file
+    journal.off = 1;
+    recording.start = latencyNow();
+    atexit(editorReplayReport);
+}
+
+int editorReplayLoad() {
+    // Read the header of the next entry if it hasn't been.  Returns 0 at the end of the recording
+    if(!recording.replay)
+        return 0;
+    if(!recording.loaded) {
+        if(fread(&recording.next, sizeof(recording.next), 1, recording.fp) != 1 || recording.next.len <= 0
+            || recording.next.len > (int)sizeof(input.buf))
+            return 0;
+        recording.loaded = 1;
+    }
+    return 1;
+}
+
+int editorReplayFeed() {
+    // Feed the next entry in as input.  Returns 0 at the end of the recording
+    if(!editorReplayLoad())
+        return 0;
+    char buf[sizeof(input.buf)];
+    int len = fread(buf, 1, recording.next.len, recording.fp);
+    recording.loaded = 0;
+    if(len <= 0)
+        return 0;
+    if(recording.next.rows - 2 != E.screenrows || recording.next.cols != E.screencols) {
+        E.screenrows = recording.next.rows - 2;
+        E.screencols = recording.next.cols;
+    }
+    recording.clock = recording.next.ns;
+    recording.chunks++;
+    recording.bytes += len;
+    editorFeedInput(buf, len);
+    return 1;
+}
+
+int editorReplayRead() {
+    // A read with nothing left in the buffer, part way through a key.  On a terminal it gives up after 100ms
+    // with nothing, so the next entry only comes in if it was recorded within that of the last.  Returns 1 if
+    // there is input now
+    if(!editorReplayLoad())
+        return 0;
+    if(recording.next.ns > recording.clock + 100000000LL) {
+        recording.clock += 100000000LL;
+        return 0;
+    }
+    return editorReplayFeed();
+}
+
+int editorReplayWait(int blocking) {
+    // Milliseconds until the next entry is due, or -1 if it won't be fed during this wait.  Replaying as fast as
+    // possible it is due straight away, but only once the editor has to wait for input.  At the end of the
+    // recording the replay is over
+    if(!editorReplayLoad()) {
+        if(blocking) {
+            // Let a save the session started finish, as it would have
+            editorSaveWait();
+            exit(0);
+        }
+        return -1;
+    }
+    if(!recording.realtime)
+        return blocking ? 0 : -1;
+    long long due = (recording.start + recording.next.ns - latencyNow()) / 1000000;
+    return (due > 0) ? due : 0;
+}
+
 /* Input */
+// Pipe the signal handlers write a byte to, so a resize or hangup wakes up poll
+int winchPipe[2] = {-1, -1};
+
+void editorHandleWinch(int sig) {
+    (void)sig;
+    int saved = errno;
+    write(winchPipe[1], "", 1);
+    errno = saved;
+}
+
+void editorHandleHangup(int sig) {
+    hangup = sig;
+    editorHandleWinch(sig);
+}
+
+void editorHangup() {
+    // The terminal went away or we were asked to stop: make sure the journal has every edit, then go without
+    // touching the file
+    editorJournalFlush();
+    if(journal.fd != -1)
+        fsync(journal.fd);
+    latencyDump();
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios);
+    _exit(1);
+}
+
+void editorResize() {
+    // The terminal changed size: the next refresh sizes the frame to match and redraws everything
+    char c;
+    while(read(winchPipe[0], &c, 1) == 1)
+        ;
+    if(getWindowSize(&E.screenrows, &E.screencols) == -1)
+        die("getWindowSize");
+    E.screenrows -= 2;
+}
+
+long long editorNowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int editorStatusShown() {
+    // The status message shows for 5 seconds after it is set
+    return E.statusmsg[0] && time(NULL) - E.statusmsg_time < 5;
+}
+
+int editorTimerWait() {
+    // Milliseconds until the screen is due to change by itself, or -1 if it isn't: save progress, lines being
+    // counted, or the status message running out
+    int counting = (view.on && !view.indexed) || (store.on && store.polled < store.n);
+    int wait = (E.save || counting) ? KILO_SAVE_TICK_MS : -1;
+    int flush = editorJournalWait();
+    if(flush >= 0 && (wait < 0 || flush < wait))
+        wait = flush;
+    if(editorStatusShown()) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        long long ms = (E.statusmsg_time + 5 - ts.tv_sec) * 1000LL - ts.tv_nsec / 1000000;
+        if(ms < 0)
+            ms = 0;
+        if(wait < 0 || ms < wait)
+            wait = ms;
+    }
+    return wait;
+}
+
+int editorWaitInput(int timeout) {
+    // Wait up to timeout milliseconds (-1 for as long as it takes) for input, and return 1 if there is some.
+    // Meanwhile rows that haven't been needed yet are highlighted a slice at a time, and resizes, save progress
+    // and the status message running out are dealt with.  When waiting for as long as it takes, the screen is
+    // refreshed for them straight away; otherwise the caller is about to refresh anyway
+    long long until = (timeout < 0) ? -1 : editorNowMs() + timeout;
+    struct pollfd fds[2] = {{E.infd, POLLIN, 0}, {winchPipe[0], POLLIN, 0}};
+    if(timeout < 0)
+        latency.waits++;
+    while(1) {
+        if(input.pos < input.len) {
+            latencyInput();
+            return 1;
+        }
+        int shown = editorStatusShown();
+        int wait = editorTimerWait();
+        long long now = editorNowMs();
+        if(until >= 0 && (wait < 0 || now + wait > until))
+            wait = (until > now) ? until - now : 0;
+        // Highlighting left to do: only look for input between slices
+        if(E.hl_pending > 0)
+            wait = 0;
+        // Replaying: the next input may be due now, or before the wait is over
+        if(recording.replay) {
+            int due = editorReplayWait(timeout < 0);
+            if(due == 0 && editorReplayFeed())
+                continue;
+            if(due > 0 && (wait < 0 || due < wait))
+                wait = due;
+            if(due < 0 && !recording.realtime)
+                return 0;
+        }
+        // A background save gets the rows to itself while we wait, as in editorReadByte
+        struct saveJob *job = E.save;
+        if(job)
+            pthread_mutex_unlock(&job->lock);
+        int n = poll(fds, (winchPipe[0] >= 0) ? 2 : 1, wait);
+        int saved = errno;
+        if(job)
+            pthread_mutex_lock(&job->lock);
+        if(n == -1 && saved != EINTR)
+            die("poll");
+        if(hangup)
+            editorHangup();
+        editorJournalTick();
+        int redraw = 0;
+        if(n > 0 && fds[1].revents) {
+            editorResize();
+            redraw = 1;
+        }
+        if(n > 0 && fds[0].revents) {
+            latencyInput();
+            return 1;
+        }
+        redraw |= editorSavePoll();
+        redraw |= editorViewPoll();
+        redraw |= editorChunkPoll();
+        // Rows on screen were drawn with a guess at their starting state that turned out wrong
+        if(E.hl_pending > 0)
+            redraw |= editorSyntaxIdle(KILO_HL_SLICE);
+        if(shown != editorStatusShown())
+            redraw = 1;
+        if(redraw && timeout < 0)
+            editorRefreshScreen();
+        if(until >= 0 && editorNowMs() >= until)
+            return 0;
+    }
+}
+
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     // Allocate memeory for input buffer
     size_t bufsize = 128;
@@ -1356,6 +7044,21 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
                     callback(buf, c);
                 return buf;
             }
+        } else if(c == PASTE_START) {
+            // Take pasted text up to the end of its first line
+            int len;
+            char *text = editorReadPaste(&len);
+            for(int j = 0; j < len && text[j] != '\r' && text[j] != '\n'; j++) {
+                if(iscntrl((unsigned char)text[j]) || (unsigned char)text[j] >= 128)
+                    continue;
+                if(buflen == bufsize - 1) {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = text[j];
+            }
+            buf[buflen] = '\0';
+            free(text);
         } else if(!iscntrl(c) && c < 128) {
             // If character is not a control character and is printable
             if(buflen == bufsize - 1) {
@@ -1377,7 +7080,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 void editorMoveCursor(int key) {
     // Move cursor when user presses arrow keys
     // Check if cursor is on an actual line
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = editorRowAt(E.cy);
 
     switch(key) {
     case ARROW_LEFT:
@@ -1386,7 +7089,7 @@ void editorMoveCursor(int key) {
         } else if (E.cy > 0) {
             // Move to end of previous line
             E.cy--;
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRowAt(E.cy)->size;
         }
         break;
         case ARROW_RIGHT:
@@ -1403,14 +7106,14 @@ void editorMoveCursor(int key) {
             }
             break;
         case ARROW_DOWN:
-            if(E.cy < E.numrows) {
+            if(E.cy < editorNumRows()) {
                 E.cy++;
             }
             break;
     }
 
     // Snap to end of line
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = editorRowAt(E.cy);
     int rowlen = row ? row->size : 0;
     if (E.cx > rowlen) {
         E.cx = rowlen;
@@ -1420,6 +7123,27 @@ void editorMoveCursor(int key) {
 void editorProcessKeypress() {
     // Handles incoming keypresses
     int c = editorReadKey();
+    long long decoded = latencyNow();
+    latencyRecord(LAT_INPUT, decoded - latency.ready);
+    int waits = latency.waits;
+    struct allocSpan span;
+    allocBegin(&span);
+
+    // Nothing changes a file being viewed: other keys do what Ctrl-L does, which is nothing.  A paste still has
+    // to be read to get past it
+    if(view.on && !editorViewAllows(c)) {
+        if(c == PASTE_START) {
+            int len;
+            free(editorReadPaste(&len));
+        }
+        editorSetStatusMessage("Read only: opened with --view");
+        c = CTRL_KEY('l');
+    }
+    // Search only looks at rows in the tree, which for a chunked file is just the window
+    if(store.on && (c == CTRL_KEY('f') || c == CTRL_KEY('r'))) {
+        editorSetStatusMessage("Search isn't available with --chunked");
+        c = CTRL_KEY('l');
+    }
 
     // Ctrl key combinations
     switch(c) {
@@ -1434,9 +7158,14 @@ void editorProcessKeypress() {
                 quit_times--;
                 return;
             }
+            // Let a background save finish first, then unsaved edits are being thrown away
+            editorSaveWait();
+            editorJournalClose();
             // clear screen, exit
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
+            if(E.outfd != -1) {
+                write(E.outfd, "\x1b[2J", 4);
+                write(E.outfd, "\x1b[H", 3);
+            }
             exit(0);
             break;
 
@@ -1450,14 +7179,24 @@ void editorProcessKeypress() {
 
         case END_KEY:
             // Go to end of the line
-            if(E.cy < E.numrows) {
-                E.cx = E.row[E.cy].size;
+            if(E.cy < editorNumRows()) {
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
 
         case CTRL_KEY('f'):
             // Find
-            editorFind();
+            editorFind(0);
+            break;
+
+        case CTRL_KEY('r'):
+            // Find a regex
+            editorFind(1);
+            break;
+
+        case CTRL_KEY('g'):
+            // Go to line
+            editorGotoLine();
             break;
 
         case BACKSPACE:
@@ -1478,8 +7217,8 @@ void editorProcessKeypress() {
                     E.cy = E.rowoff;
                 } else if(c == PAGE_DOWN) {
                     E.cy = E.rowoff + E.screenrows - 1;
-                    if(E.cy > E.numrows) {
-                        E.cy = E.numrows;
+                    if(E.cy > editorNumRows()) {
+                        E.cy = editorNumRows();
                     }
                 }
                 // Get number of rows on screen and scroll up that many times.
@@ -1499,8 +7238,33 @@ void editorProcessKeypress() {
             // doesn't work lol
         
         case CTRL_KEY('l'):
+            // Ignore refresh screen
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+
+        case CTRL_KEY('t'):
+            latencyShow();
+            break;
+
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+
+        case PASTE_START: {
+            // Insert the whole paste at once
+            int len;
+            char *text = editorReadPaste(&len);
+            editorPaste(text, len);
+            free(text);
+            break;
+        }
+
         case '\x1b':
-            // Ignore refresh screen and escape sequence
+            // Stop showing search matches
+            editorMatchClear();
             break;
         
         default:
@@ -1509,11 +7273,20 @@ void editorProcessKeypress() {
     }
 
     quit_times = U.quitTimes;
+    // Bring the row offset up to the cursor now rather than at the next frame, so the next key sees the same
+    // screen however many keys are handled before a frame is drawn
+    editorScroll();
+    // Keys that open a prompt wait for more keys, which isn't time spent editing
+    if(latency.waits == waits) {
+        latencyRecord(LAT_EDIT, latencyNow() - decoded);
+        allocEnd(&span, ALLOC_KEY);
+    }
 }
 
 /* Init */
-void initEditor() {
-    /* Init all fields in E (editor config) struct */
+void editorInitCore(int rows, int cols) {
+    /* Init all fields in E (editor config) struct, for a screen of rows by cols.  Nothing here touches the
+       terminal: frames are drawn in memory until outfd is set */
 
     // Init cursor values
     E.cx = 0;
@@ -1524,10 +7297,11 @@ void initEditor() {
     E.rowoff = 0;
     // Init column offset
     E.coloff = 0;
-    // Init number of rows for editor
-    E.numrows = 0;
-    // Init current row to null
-    E.row = NULL;
+    // Init row tree with an empty leaf
+    E.rows = rowNodeNew(1);
+    // No file mapped yet
+    E.map = NULL;
+    E.maplen = 0;
     // Init dirty flag - buffer has not been modified
     E.dirty = 0;
     // Init currently open filename to null
@@ -1538,30 +7312,330 @@ void initEditor() {
     E.statusmsg_time = 0;
     // Init syntax highlight. NULL - no filetype
     E.syntax = NULL;
+    E.hl_stale_from = 0;
+    E.hl_pending = 0;
+    E.save = NULL;
+    E.save_pending = 0;
+    // No frame until the first refresh sizes it
+    E.frame = NULL;
+    E.frame_attr = NULL;
+    E.shadow = NULL;
+    E.shadow_attr = NULL;
+    E.frame_rows = E.frame_cols = 0;
+    E.shadow_cy = E.shadow_cx = -1;
+    E.infd = -1;
+    E.outfd = -1;
+    E.frame_bytes = 0;
+    editorInitSgr();
+
+    // Make room for status bar and status message
+    E.screenrows = rows - 2;
+    E.screencols = cols;
+
+    configDefaults(&U);
+    quit_times = U.quitTimes;
+}
 
+void initEditor() {
     // Set window size
-    if(getWindowSize(&E.screenrows, &E.screencols) == -1)
+    int rows, cols;
+    if(getWindowSize(&rows, &cols) == -1)
         die("getWindowSize");
-    // Make room for status bar and status message
-    E.screenrows -= 2;
+    editorInitCore(rows, cols);
+    E.infd = STDIN_FILENO;
+    E.outfd = STDOUT_FILENO;
 
     configOpen("bin/.kilorc");
     quit_times = U.quitTimes;
+    atexit(latencyDump);
+#ifdef KILO_ALLOC_PROFILE
+    allocInit();
+    atexit(allocReport);
+#endif
+
+    // Resizes wake the main loop up through a pipe
+    if(pipe(winchPipe) == -1)
+        die("pipe");
+    fcntl(winchPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(winchPipe[1], F_SETFL, O_NONBLOCK);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorHandleWinch;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+    sa.sa_handler = editorHandleHangup;
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 }
 
+#ifndef KILO_BENCH
 int main(int argc, char *argv[]) {
-    enableRawMode();
-    initEditor();
+    // Options, then the file to edit
+    char *filename = NULL;
+    char *record = NULL;
+    char *replay = NULL;
+    int realtime = 0;
+    int viewing = 0;
+    int chunked = 0;
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--record") && i + 1 < argc) {
+            record = argv[++i];
+        } else if(!strcmp(argv[i], "--replay") && i + 1 < argc) {
+            replay = argv[++i];
+        } else if(!strcmp(argv[i], "--realtime")) {
+            realtime = 1;
+        } else if(!strcmp(argv[i], "--view")) {
+            viewing = 1;
+        } else if(!strcmp(argv[i], "--chunked")) {
+            chunked = 1;
+        } else if(argv[i][0] == '-' && argv[i][1] == '-') {
+            fprintf(stderr, "Usage: kilo [--record FILE | --replay FILE [--realtime]] [--view | --chunked] [file]\n");
+            exit(1);
+        } else {
+            filename = argv[i];
+        }
+    }
 
-    if(argc >= 2) {
-        editorOpen(argv[1]);
+    if(replay) {
+        editorReplayStart(replay, realtime);
+    } else {
+        enableRawMode();
+        initEditor();
+        if(record)
+            editorRecordStart(record);
+    }
+
+    if(filename && viewing) {
+        editorViewOpen(filename);
+    } else if(filename && chunked) {
+        editorChunkOpen(filename);
+    } else if(filename) {
+        editorOpen(filename);
     }
 
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-F = find | CTRL-Q = quit");
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-F = find | Ctrl-R = regex | Ctrl-G = go to line | Ctrl-Z/Y = undo/redo | CTRL-Q = quit");
+    if(viewing)
+        editorSetStatusMessage("HELP: Ctrl-G = go to line ($ for the end) | CTRL-Q = quit");
+    if(store.on)
+        editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-G = go to line ($ for the end) | Ctrl-Z/Y = undo/redo | CTRL-Q = quit");
+    if(filename && !replay && !viewing && !store.on) {
+        editorJournalOpen();
+    }
 
     while(1) {
         editorRefreshScreen();
+        long long drawn = editorNowMs();
+        editorProcessKeypress();
+        // Apply every key that is already waiting, or that comes before the next frame is due, then draw once
+        while(1) {
+            long long left = drawn + KILO_FRAME_MS - editorNowMs();
+            if(!editorWaitInput(left > 0 ? left : 0))
+                break;
+            editorProcessKeypress();
+        }
+    }
+    return 0;
+}
+#endif
+
+/* Benchmarks */
+#ifdef KILO_BENCH
+// make bench: time the editor core on its own, with no terminal.  A C file of the size given on the command
+// line (in MB, 64 by default) is generated, and frames are drawn for an 80x24 screen in memory, counting the
+// bytes that would have been written for each
+long long benchNowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void benchReport(const char *name, int ops, long long ns, long long bytes, int frames) {
+    printf("%-14s %9d ops %14.0f ns/op", name, ops, (double)ns / ops);
+    if(frames > 0)
+        printf(" %10.1f bytes/frame", (double)bytes / frames);
+    printf("\n");
+}
+
+char *benchFile(int mb) {
+    // Write a C file of about mb megabytes to /tmp: functions of statements, comments and strings, with a
+    // needle to search for every thousand lines
+    char *path = strdup("/tmp/kilo-bench-XXXXXX.c");
+    int fd = mkstemps(path, 2);
+    if(fd == -1)
+        die("mkstemps");
+    FILE *fp = fdopen(fd, "w");
+    long long size = (long long)mb << 20;
+    long long written = 0;
+    for(int line = 0; written < size; line++) {
+        if(line % 20 == 0) {
+            written += fprintf(fp, "/* Function %d:\n   works out a value */\nint function%d(int x) {\n", line, line);
+        } else if(line % 20 == 19) {
+            written += fprintf(fp, "    return x;\n}\n\n");
+        } else if(line % 1000 == 500) {
+            written += fprintf(fp, "    x += lookup(\"needle %d\");\n", line);
+        } else {
+            written += fprintf(fp, "\tx = x * %d + 0x%x; // step %d of \"%s\"\n", line, line * 7, line % 20, "work");
+        }
+    }
+    fclose(fp);
+    return path;
+}
+
+long long benchKey(const char *keys, int *frames) {
+    // Feed one key as if typed, handle it and draw a frame.  Returns the bytes the frame took
+    editorFeedInput(keys, strlen(keys));
+    while(input.pos < input.len) {
         editorProcessKeypress();
     }
+    editorRefreshScreen();
+    (*frames)++;
+    return E.frame_bytes;
+}
+
+int main(int argc, char *argv[]) {
+    int mb = (argc >= 2) ? atoi(argv[1]) : 64;
+    if(mb < 1)
+        mb = 1;
+    editorInitCore(24, 80);
+#ifdef KILO_ALLOC_PROFILE
+    allocInit();
+#endif
+    char *path = benchFile(mb);
+    printf("%d MB, %d threads\n", mb, U.findThreads);
+    long long t, bytes;
+    int frames, ops;
+
+    // Open the file and draw the first screen
+    ops = 5;
+    t = benchNowNs();
+    for(int i = 0; i < ops; i++) {
+        if(i > 0)
+            editorClose();
+        editorOpen(path);
+        editorRefreshScreen();
+    }
+    benchReport("open", ops, benchNowNs() - t, 0, 0);
+    printf("%d rows\n", editorNumRows());
+
+    // Frames with nothing to change
+    ops = 100000;
+    t = benchNowNs();
+    for(int i = 0; i < ops; i++) {
+        editorRefreshScreen();
+    }
+    benchReport("idle frame", ops, benchNowNs() - t, 0, 0);
+
+    // Typing at the top of the file, a frame after each key
+    ops = 20000;
+    frames = 0;
+    bytes = 0;
+    t = benchNowNs();
+    for(int i = 0; i < ops; i++) {
+        bytes += benchKey((i % 40 == 39) ? "\r" : "x", &frames);
+    }
+    benchReport("type at top", ops, benchNowNs() - t, bytes, frames);
+
+    // Inserting rows anywhere in the file
+    ops = 100000;
+    srand(1);
+    t = benchNowNs();
+    for(int i = 0; i < ops; i++) {
+        editorInsertRow(rand() % (editorNumRows() + 1), "    inserted();", 15);
+    }
+    benchReport("insert row", ops, benchNowNs() - t, 0, 0);
+
+    // Highlighting rows from the top
+    ops = 100000;
+    erow *row = editorRowAt(0);
+    t = benchNowNs();
+    for(int i = 0; i < ops && row; i++) {
+        editorUpdateSyntax(row, 1);
+        row = editorRowNext(row);
+    }
+    benchReport("update syntax", ops, benchNowNs() - t, 0, 0);
+
+    // Pasting 1 MB at the top, then undoing it
+    int plen = 1 << 20;
+    char *paste = malloc(plen);
+    for(int j = 0; j < plen; j++) {
+        paste[j] = (j % 64 == 63) ? '\n' : "pasted text "[j % 12];
+    }
+    ops = 10;
+    long long undone = 0;
+    frames = 0;
+    t = benchNowNs();
+    for(int i = 0; i < ops; i++) {
+        E.cx = E.cy = 0;
+        editorPaste(paste, plen);
+        editorRefreshScreen();
+        long long u = benchNowNs();
+        benchKey("\x1a", &frames);
+        undone += benchNowNs() - u;
+    }
+    benchReport("paste 1MB", ops, benchNowNs() - t - undone, 0, 0);
+    benchReport("undo paste", ops, undone, 0, 0);
+    free(paste);
+
+    // Scrolling down a line at a time once the cursor is at the bottom, then a page at a time
+    E.cx = E.cy = E.rowoff = 0;
+    editorRefreshScreen();
+    ops = 20000;
+    frames = 0;
+    bytes = 0;
+    t = benchNowNs();
+    for(int i = 0; i < ops; i++) {
+        bytes += benchKey("\x1b[B", &frames);
+    }
+    benchReport("scroll line", ops, benchNowNs() - t, bytes, frames);
+    ops = 5000;
+    frames = 0;
+    bytes = 0;
+    t = benchNowNs();
+    for(int i = 0; i < ops; i++) {
+        bytes += benchKey("\x1b[6~", &frames);
+    }
+    benchReport("scroll page", ops, benchNowNs() - t, bytes, frames);
+
+    // Searching the whole file, as typed: each key narrows the search down and draws a frame
+    E.cx = E.cy = E.rowoff = 0;
+    ops = 5;
+    frames = 0;
+    t = benchNowNs();
+    for(int i = 0; i < ops; i++) {
+        benchKey("\x06needle 1\r", &frames);
+        benchKey("\x1b", &frames);
+        editorFindReset();
+    }
+    benchReport("search", ops, benchNowNs() - t, 0, 0);
+    ops = 5;
+    t = benchNowNs();
+    for(int i = 0; i < ops; i++) {
+        benchKey("\x12nee+dle [0-9]+0\r", &frames);
+        benchKey("\x1b", &frames);
+        editorFindReset();
+    }
+    benchReport("regex search", ops, benchNowNs() - t, 0, 0);
+
+    // Saving, up to the file being in place
+    ops = 3;
+    t = benchNowNs();
+    for(int i = 0; i < ops; i++) {
+        editorSave();
+        editorSaveWait();
+    }
+    benchReport("save", ops, benchNowNs() - t, 0, 0);
+
+    printf("\nStages of the keys and frames above:\n");
+    latencyWrite(stdout);
+#ifdef KILO_ALLOC_PROFILE
+    printf("\nAllocations:\n");
+    allocWrite(stdout);
+#endif
+
+    editorJournalClose();
+    unlink(path);
+    free(path);
     return 0;
 }
+#endif